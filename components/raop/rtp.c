@@ -69,29 +69,43 @@
 
 //#define __RTP_STORE
 
-// default buffer size
-#define BUFFER_FRAMES 	( (150 * RAOP_SAMPLE_RATE * 2) / (352 * 100) )
+// jitter buffer slots, power of 2 so that it divides seqno space (~1s of 352 frames packets)
+#define JB_SLOTS		128
 #define MAX_PACKET       1408
 #define MIN_LATENCY		11025
 #define MAX_LATENCY   	( (120 * RAOP_SAMPLE_RATE * 2) / 100 )
 
 #define RTP_STACK_SIZE	(4*1024)
+#define PLAYER_STACK_SIZE	(4*1024)
+#define PLAYER_WAKEUP	20		// ms, so that missing frames are replaced on time
 
 #define RTP_SYNC	(0x01)
 #define NTP_SYNC	(0x02)
 
-#define RESEND_TO	200
+#define RESEND_TO	200		// ms between requests of the same packet
+#define RESEND_MIN	20		// ms, below that an answer would not be in time
+
+// playout depth, in packets, adapts between these to inter-arrival jitter and losses
+#define JB_MIN_DEPTH	4
+#define JB_MAX_DEPTH	((JB_SLOTS * 3) / 4)
+#define JB_JITTER_K		4		// depth covers that many times the jitter
+#define JB_DECAY		64		// packets below target before depth shrinks by one
+
+#define NTP_SAMPLES		16		// regression window
+#define NTP_MIN_FIT		4		// below that, skew is not estimated
+#define NTP_MAX_SKEW	1000	// ppm
+#define NTP_RTT_WINDOW	8		// roundtrips, discarded ones included, the best one is taken from
 
 enum { DATA = 0, CONTROL, TIMING };
 
 static const u8_t silence_frame[MAX_PACKET] = { 0 };
 
 typedef u16_t seq_t;
-typedef struct audio_buffer_entry {   // decoded audio packets
+typedef struct audio_buffer_entry {   // raw audio packets
 	int ready;
 	u32_t rtptime, last_resend;
-	s16_t *data;
-	int len;
+	char *data, *payload;		// whole datagram is received in slot
+	int len;					// of payload
 } abuf_t;
 
 typedef struct rtp_s {
@@ -106,7 +120,7 @@ typedef struct rtp_s {
 	mbedtls_aes_context aes;
 #endif
 	bool decrypt;
-	u8_t *decrypt_buf;
+	s16_t *pcm_buf;
 	u32_t frame_size, frame_duration;
 	u32_t in_frames, out_frames;
 	struct in_addr host;
@@ -117,6 +131,20 @@ typedef struct rtp_s {
 	} rtp_sockets[3]; 					 // data, control, timing
 	struct timing_s {
 		u64_t local, remote;
+		struct {
+			u32_t local;
+			u64_t remote;
+		} samples[NTP_SAMPLES];
+		int count, head;
+		u32_t rtt[NTP_RTT_WINDOW];
+		int rtt_count, rtt_head;
+		u32_t discarded;
+		// fit is remote = remote0 + my + slope * (local - local0 - mx), in ms
+		u32_t local0;
+		u64_t remote0;
+		double mx, my, slope;
+		s32_t skew;			// ppm of remote clock vs local clock
+		s32_t offset;		// us between last sample and fit
 	} timing;
 	struct {
 		u32_t 	rtp, time;
@@ -131,33 +159,50 @@ typedef struct rtp_s {
 	u32_t resent_req, resent_rec;	// total resent + recovered frames
 	u32_t silent_frames;	// total silence frames
 	u32_t discarded;
-	abuf_t audio_buffer[BUFFER_FRAMES];
+	struct {
+		u32_t arrival, rtptime;	// last in-order packet
+		s32_t jitter;			// RFC3550 inter-arrival jitter, in 1/16 ms
+		s32_t loss;				// average gap per packet, in 1/65536
+		int depth, calm;		// playout depth in packets
+		u32_t late;				// packets received after their slot was played
+	} jb;
+	abuf_t *audio_buffer;		// slots and packets are a single slab
+	abuf_t *decoding;			// slot being decoded by player, out of the lock
 	seq_t ab_read, ab_write;
 	pthread_mutex_t ab_mutex;
+	pthread_cond_t ab_cond;
 #ifdef WIN32
-	pthread_t thread;
+	pthread_t thread, player;
 #else
-	TaskHandle_t thread, joiner;
-	StaticTask_t *xTaskBuffer;
-    StackType_t *xStack;
+	TaskHandle_t thread, player, joiner;
+	StaticTask_t *xTaskBuffer, *xPlayerTaskBuffer;
+    StackType_t *xStack, *xPlayerStack;
 #endif
 
 	struct alac_codec_s *alac_codec;
 	int flush_seqno;
+	bool pushing;				// player is decoding/pushing out of the lock, flush waits for it
+	pthread_cond_t push_cond;
 	bool playing;
 	raop_data_cb_t data_cb;
 	raop_cmd_cb_t cmd_cb;
 } rtp_t;
 
 
-#define BUFIDX(seqno) ((seq_t)(seqno) % BUFFER_FRAMES)
-static void 	buffer_alloc(abuf_t *audio_buffer, int size);
+#define BUFIDX(seqno) ((seq_t)(seqno) & (JB_SLOTS - 1))
+static abuf_t*	buffer_alloc(int size);
 static void 	buffer_release(abuf_t *audio_buffer);
 static void 	buffer_reset(abuf_t *audio_buffer);
+static void 	buffer_jitter(rtp_t *ctx, u32_t rtptime, int gap);
 static void 	buffer_push_packet(rtp_t *ctx);
+static void 	buffer_resend(rtp_t *ctx, u32_t now, u32_t hold);
 static bool 	rtp_request_resend(rtp_t *ctx, seq_t first, seq_t last);
 static bool 	rtp_request_timing(rtp_t *ctx);
+static void 	timing_add_sample(rtp_t *ctx, u32_t local, u64_t remote, u32_t rtt);
+static u32_t 	timing_remote2local(rtp_t *ctx, u64_t remote);
+static u32_t 	rtp_playtime(rtp_t *ctx, u32_t rtptime);
 static void*	rtp_thread_func(void *arg);
+static void*	rtp_player_func(void *arg);
 static int	  	seq_order(seq_t a, seq_t b);
 
 /*---------------------------------------------------------------------------*/
@@ -221,9 +266,13 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 	ctx->rtp_host.sin_family = AF_INET;
 	ctx->rtp_host.sin_addr.s_addr = INADDR_ANY;
 	pthread_mutex_init(&ctx->ab_mutex, 0);
+	pthread_cond_init(&ctx->ab_cond, 0);
+	pthread_cond_init(&ctx->push_cond, 0);
 	ctx->flush_seqno = -1;
+	ctx->timing.slope = 1;
 	ctx->latency = latency;
 	ctx->ab_read = ctx->ab_write;
+	ctx->jb.depth = JB_MIN_DEPTH;
 
 #ifdef __RTP_STORE
 	ctx->rtpIN = fopen("airplay.rtpin", "wb");
@@ -242,7 +291,6 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 		mbedtls_aes_setkey_dec(&ctx->aes, (unsigned char*) aeskey, 128);
 #endif
 		ctx->decrypt = true;
-		ctx->decrypt_buf = malloc(MAX_PACKET);
 	}
 
 	memset(fmtp, 0, sizeof(fmtp));
@@ -255,7 +303,10 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 	ctx->alac_codec = alac_init(fmtp);
 	rc &= ctx->alac_codec != NULL;
 
-	buffer_alloc(ctx->audio_buffer, ctx->frame_size*4);
+	// jitter buffer holds received datagrams, decoding happens in place when they are played
+	ctx->audio_buffer = buffer_alloc(MAX_PACKET);
+	ctx->pcm_buf = malloc(ctx->frame_size*4);
+	rc &= ctx->audio_buffer && ctx->pcm_buf;
 
 	// create rtp ports
 	for (i = 0; i < 3; i++) {
@@ -272,12 +323,17 @@ rtp_resp_t rtp_init(struct in_addr host, int latency, char *aeskey, char *aesiv,
 		ctx->running = true;
 #ifdef WIN32
 		pthread_create(&ctx->thread, NULL, rtp_thread_func, (void *) ctx);
+		pthread_create(&ctx->player, NULL, rtp_player_func, (void *) ctx);
 #else
 		// xTaskCreate((TaskFunction_t) rtp_thread_func, "RTP_thread", RTP_TASK_SIZE, ctx,  CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1 , &ctx->thread);
 		ctx->xTaskBuffer = (StaticTask_t*) heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 		ctx->xStack = (StackType_t*) malloc(RTP_STACK_SIZE);
 		ctx->thread = xTaskCreateStatic( (TaskFunction_t) rtp_thread_func, "RTP_thread", RTP_STACK_SIZE, ctx, 
 										 CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1, ctx->xStack, ctx->xTaskBuffer );
+		ctx->xPlayerTaskBuffer = (StaticTask_t*) heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+		ctx->xPlayerStack = (StackType_t*) malloc(PLAYER_STACK_SIZE);
+		ctx->player = xTaskCreateStatic( (TaskFunction_t) rtp_player_func, "RTP_player", PLAYER_STACK_SIZE, ctx, 
+										 CONFIG_ESP32_PTHREAD_TASK_PRIO_DEFAULT + 1, ctx->xPlayerStack, ctx->xPlayerTaskBuffer );
 #endif
 	} else {
 		rtp_end(ctx);
@@ -303,20 +359,27 @@ void rtp_end(rtp_t *ctx)
 		ctx->running = false;
 #ifdef WIN32
 		pthread_join(ctx->thread, NULL);
+		pthread_join(ctx->player, NULL);
 #else
-		xTaskNotifyWait(0, 0, NULL, portMAX_DELAY);
+		// both tasks notify when they exit
+		ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+		ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
 		free(ctx->xStack);
 		heap_caps_free(ctx->xTaskBuffer);
+		free(ctx->xPlayerStack);
+		heap_caps_free(ctx->xPlayerTaskBuffer);
 #endif
 	}
 	
 	for (i = 0; i < 3; i++) closesocket(ctx->rtp_sockets[i].sock);
 
 	if (ctx->alac_codec) alac_delete_decoder(ctx->alac_codec);
-	if (ctx->decrypt_buf) free(ctx->decrypt_buf);
+	if (ctx->pcm_buf) free(ctx->pcm_buf);
 	
+	pthread_cond_destroy(&ctx->ab_cond);
+	pthread_cond_destroy(&ctx->push_cond);
 	pthread_mutex_destroy(&ctx->ab_mutex);
-	buffer_release(ctx->audio_buffer);
+	if (ctx->audio_buffer) buffer_release(ctx->audio_buffer);
 	
 	free(ctx);
 
@@ -337,6 +400,8 @@ bool rtp_flush(rtp_t *ctx, unsigned short seqno, unsigned int rtptime)
 		LOG_ERROR("[%p]: FLUSH ignored as same as RECORD (%hu - %u)", ctx, seqno, rtptime);
 	} else {
 		pthread_mutex_lock(&ctx->ab_mutex);
+		// a frame being pushed must reach sink before it is flushed, not after
+		while (ctx->pushing) pthread_cond_wait(&ctx->push_cond, &ctx->ab_mutex);
 		buffer_reset(ctx->audio_buffer);
 		ctx->playing = false;
 		ctx->flush_seqno = seqno;
@@ -359,26 +424,63 @@ void rtp_record(rtp_t *ctx, unsigned short seqno, unsigned rtptime)
 }
 
 /*---------------------------------------------------------------------------*/
-static void buffer_alloc(abuf_t *audio_buffer, int size) {
+static abuf_t *buffer_alloc(int size) {
 	int i;
-	for (i = 0; i < BUFFER_FRAMES; i++) {
-		audio_buffer[i].data = malloc(size);
+	abuf_t *audio_buffer = malloc(JB_SLOTS * (sizeof(abuf_t) + size));
+	char *data;
+
+	if (!audio_buffer) return NULL;
+	data = (char*) (audio_buffer + JB_SLOTS);
+
+	for (i = 0; i < JB_SLOTS; i++) {
+		audio_buffer[i].data = data + i * size;
 		audio_buffer[i].ready = 0;
 	}
+
+	return audio_buffer;
 }
 
 /*---------------------------------------------------------------------------*/
 static void buffer_release(abuf_t *audio_buffer) {
-	int i;
-	for (i = 0; i < BUFFER_FRAMES; i++) {
-		free(audio_buffer[i].data);
-	}
+	free(audio_buffer);
 }
 
 /*---------------------------------------------------------------------------*/
 static void buffer_reset(abuf_t *audio_buffer) {
 	int i;
-	for (i = 0; i < BUFFER_FRAMES; i++) audio_buffer[i].ready = 0;
+	for (i = 0; i < JB_SLOTS; i++) audio_buffer[i].ready = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+// update jitter and loss estimates with an in-order packet and adapt playout depth
+static void buffer_jitter(rtp_t *ctx, u32_t rtptime, int gap) {
+	u32_t now = gettime_ms();
+	int target;
+
+	if (ctx->jb.arrival) {
+		s32_t d = (s32_t) (now - ctx->jb.arrival) - (s32_t) (((u64_t) (rtptime - ctx->jb.rtptime) * 1000) / RAOP_SAMPLE_RATE);
+		ctx->jb.jitter += ((abs(d) << 4) - ctx->jb.jitter) >> 4;
+	}
+
+	ctx->jb.arrival = now;
+	ctx->jb.rtptime = rtptime;
+	ctx->jb.loss += ((min(gap, JB_SLOTS) << 16) - ctx->jb.loss) >> 6;
+
+	// when there are losses, leave time for a resend
+	target = JB_JITTER_K * (ctx->jb.jitter >> 4);
+	if (ctx->jb.loss) target += RESEND_TO;
+	target = (target * RAOP_SAMPLE_RATE) / (1000 * ctx->frame_size) + 1;
+	target = max(min(target, JB_MAX_DEPTH), JB_MIN_DEPTH);
+
+	// grow at once, shrink slowly
+	if (target > ctx->jb.depth) {
+		LOG_DEBUG("[%p]: jitter buffer depth %d => %d (jitter:%d ms)", ctx, ctx->jb.depth, target, ctx->jb.jitter >> 4);
+		ctx->jb.depth = target;
+		ctx->jb.calm = 0;
+	} else if (target < ctx->jb.depth && ++ctx->jb.calm > JB_DECAY) {
+		ctx->jb.depth--;
+		ctx->jb.calm = 0;
+	}
 }
 
 /*---------------------------------------------------------------------------*/
@@ -390,33 +492,35 @@ static int seq_order(seq_t a, seq_t b) {
 }
 
 /*---------------------------------------------------------------------------*/
+// decrypt in place (buf is modified) then decode
 static void alac_decode(rtp_t *ctx, s16_t *dest, char *buf, int len, int *outsize) {
 	unsigned char iv[16];
 	int aeslen;
 	assert(len<=MAX_PACKET);
 
 	if (ctx->decrypt) {
+		// trailing bytes that are not a full AES block are in clear
 		aeslen = len & ~0xf;
 		memcpy(iv, ctx->aesiv, sizeof(iv));
 #ifdef WIN32
-		AES_cbc_encrypt((unsigned char*)buf, ctx->decrypt_buf, aeslen, &ctx->aes, iv, AES_DECRYPT);
+		AES_cbc_encrypt((unsigned char*) buf, (unsigned char*) buf, aeslen, &ctx->aes, iv, AES_DECRYPT);
 #else
-		mbedtls_aes_crypt_cbc(&ctx->aes, MBEDTLS_AES_DECRYPT, aeslen, iv, (unsigned char*) buf, ctx->decrypt_buf);
+		mbedtls_aes_crypt_cbc(&ctx->aes, MBEDTLS_AES_DECRYPT, aeslen, iv, (unsigned char*) buf, (unsigned char*) buf);
 #endif
-		memcpy(ctx->decrypt_buf+aeslen, buf+aeslen, len-aeslen);
-		alac_to_pcm(ctx->alac_codec, (unsigned char*) ctx->decrypt_buf, (unsigned char*) dest, 2, (unsigned int*) outsize);
-	} else {
-		alac_to_pcm(ctx->alac_codec, (unsigned char*) buf, (unsigned char*) dest, 2, (unsigned int*) outsize);
-	}	
+	}
+
+	alac_to_pcm(ctx->alac_codec, (unsigned char*) buf, (unsigned char*) dest, 2, (unsigned int*) outsize);	
 	
 	*outsize *= 4;
 }
 
 
 /*---------------------------------------------------------------------------*/
-static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool first, char *data, int len) {
+// datagram is still pending in sock, it is received in its slot, or in scratch when not stored
+static void buffer_put_packet(rtp_t *ctx, int sock, seq_t seqno, unsigned rtptime, bool first, int offset, char *scratch) {
 	abuf_t *abuf = NULL;
 	u32_t playtime;
+	int len;
 
 	pthread_mutex_lock(&ctx->ab_mutex);
 
@@ -428,9 +532,11 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 			ctx->flush_seqno = -1;
 			ctx->playing = true;
 			ctx->resent_req = ctx->resent_rec = ctx->silent_frames = ctx->discarded = 0;
-			playtime = ctx->synchro.time + (((s32_t)(rtptime - ctx->synchro.rtp)) * 1000) / RAOP_SAMPLE_RATE;
+			ctx->jb.late = ctx->jb.arrival = 0;
+			playtime = rtp_playtime(ctx, rtptime);
 			ctx->cmd_cb(RAOP_PLAY, &playtime);
 		} else {
+			recvfrom(sock, scratch, MAX_PACKET, 0, NULL, NULL);
 			pthread_mutex_unlock(&ctx->ab_mutex);
 			return;
 		}
@@ -440,23 +546,29 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 		// expected packet
 		abuf = ctx->audio_buffer + BUFIDX(seqno);
 		ctx->ab_write = seqno;
+		buffer_jitter(ctx, rtptime, 0);
 		LOG_SDEBUG("packet expected seqno:%hu rtptime:%u (W:%hu R:%hu)", seqno, rtptime, ctx->ab_write, ctx->ab_read);
 
 	} else if (seq_order(ctx->ab_write, seqno)) {
-		// newer than expected
-		if (ctx->latency && seq_order(ctx->latency / ctx->frame_size, seqno - ctx->ab_write - 1)) {
-			// only get rtp latency-1 frames back (last one is seqno)
+		// newer than expected, cannot hold more than rtp latency nor jitter buffer slots
+		seq_t window = JB_SLOTS - 1;
+		if (ctx->latency) window = min(window, ctx->latency / ctx->frame_size);
+		buffer_jitter(ctx, rtptime, (seq_t) (seqno - ctx->ab_write - 1));
+		if (seq_order(window, seqno - ctx->ab_write - 1)) {
+			// only get window-1 frames back (last one is seqno)
 			LOG_WARN("[%p] too many missing frames %hu seq: %hu, (W:%hu R:%hu)", ctx, seqno - ctx->ab_write - 1, seqno, ctx->ab_write, ctx->ab_read);
-			ctx->ab_write = seqno - ctx->latency / ctx->frame_size;
+			ctx->ab_write = seqno - window;
 		}
-		if (ctx->latency && seq_order(ctx->latency / ctx->frame_size, seqno - ctx->ab_read)) {
-			// if ab_read is lagging more than http latency, advance it
+		if (seq_order(window, seqno - ctx->ab_read)) {
+			// if ab_read is lagging more than window, advance it
 			LOG_WARN("[%p] on hold for too long %hu (W:%hu R:%hu)", ctx, seqno - ctx->ab_read + 1, ctx->ab_write, ctx->ab_read);
-			ctx->ab_read = seqno - ctx->latency / ctx->frame_size + 1;
+			ctx->ab_read = seqno - window + 1;
 		}
-		if (rtp_request_resend(ctx, ctx->ab_write + 1, seqno-1)) {
+		{
 			seq_t i;
 			u32_t now = gettime_ms();
+			// ask right away, otherwise let the scheduler do it at its next round
+			if (!rtp_request_resend(ctx, ctx->ab_write + 1, seqno-1)) now -= RESEND_TO;
 			for (i = ctx->ab_write + 1; seq_order(i, seqno); i++) {
 				ctx->audio_buffer[BUFIDX(i)].rtptime = rtptime - (seqno-i)*ctx->frame_size;
 				ctx->audio_buffer[BUFIDX(i)].last_resend = now;
@@ -466,30 +578,46 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 		abuf = ctx->audio_buffer + BUFIDX(seqno);
 		ctx->ab_write = seqno;
 	} else if (seq_order(ctx->ab_read, seqno + 1)) {
-		// recovered packet, not yet sent
-		abuf = ctx->audio_buffer + BUFIDX(seqno);
-		ctx->resent_rec++;
+		// recovered packet, not yet sent (or duplicated answer to a resend)
+		if (!ctx->audio_buffer[BUFIDX(seqno)].ready) {
+			abuf = ctx->audio_buffer + BUFIDX(seqno);
+			ctx->resent_rec++;
+		}
 		LOG_DEBUG("[%p]: packet recovered seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
 	} else {
 		// too late
+		ctx->jb.late++;
 		LOG_DEBUG("[%p]: packet too late seqno:%hu rtptime:%u (W:%hu R:%hu)", ctx, seqno, rtptime, ctx->ab_write, ctx->ab_read);
 	}
 
 	if (ctx->in_frames++ > 1000) {
-		LOG_INFO("[%p]: fill [level:%hu rec:%u] [W:%hu R:%hu]", ctx, ctx->ab_write - ctx->ab_read, ctx->resent_rec, ctx->ab_write, ctx->ab_read);
+		LOG_INFO("[%p]: fill [level:%hu depth:%d jitter:%d ms rec:%u] [W:%hu R:%hu]", ctx, ctx->ab_write - ctx->ab_read, ctx->jb.depth, ctx->jb.jitter >> 4, ctx->resent_rec, ctx->ab_write, ctx->ab_read);
 		ctx->in_frames = 0;
 	}
 
-	if (abuf) {
-		alac_decode(ctx, abuf->data, data, len, &abuf->len);
+	// only after a blackout of a whole slab could a packet land in the slot being decoded
+	if (abuf && abuf == ctx->decoding) {
+		LOG_WARN("[%p]: slot busy, dropping seqno:%hu (W:%hu R:%hu)", ctx, seqno, ctx->ab_write, ctx->ab_read);
+		abuf = NULL;
+	}
+
+	// datagram is already there, so this is just a copy out of the network stack
+	len = recvfrom(sock, abuf ? abuf->data : scratch, MAX_PACKET, 0, NULL, NULL) - offset;
+
+	// check if packet contains enough content to be reasonable, otherwise it is missing
+	if (abuf && len < 16) {
+		abuf->ready = 0;
+	} else if (abuf) {
+		// only store the raw packet, player decrypts and decodes it out of the lock
+		abuf->payload = abuf->data + offset;
+		abuf->len = len;
 		abuf->ready = 1;
 		// this is the local rtptime when this frame is expected to play
 		abuf->rtptime = rtptime;
-		buffer_push_packet(ctx);
+		pthread_cond_signal(&ctx->ab_cond);
 
 #ifdef __RTP_STORE
-		fwrite(data, len, 1, ctx->rtpIN);
-		fwrite(abuf->data, abuf->len, 1, ctx->rtpOUT);
+		fwrite(abuf->payload, len, 1, ctx->rtpIN);
 #endif
 	}
 
@@ -497,61 +625,150 @@ static void buffer_put_packet(rtp_t *ctx, seq_t seqno, unsigned rtptime, bool fi
 }
 
 /*---------------------------------------------------------------------------*/
-// push as many frames as possible through callback
+// push as many frames as possible through callback - called with ab_mutex, released while decoding and pushing
 static void buffer_push_packet(rtp_t *ctx) {
 	abuf_t *curframe = NULL;
 	u32_t now, playtime, hold = max((ctx->latency * 1000) / (8 * RAOP_SAMPLE_RATE), 100);
-	int i;
 
 	// not ready to play yet
 	if (!ctx->playing ||  ctx->synchro.status != (RTP_SYNC | NTP_SYNC)) return;
 
-	// maybe re-evaluate time in loop in case data callback blocks ...
-	now = gettime_ms();
+	now = playtime = gettime_ms();
 
-	// there is always at least one frame in the buffer
-	do {
+	// play up to the most recent frame received
+	while (ctx->playing && seq_order(ctx->ab_read, ctx->ab_write + 1)) {
 
 		curframe = ctx->audio_buffer + BUFIDX(ctx->ab_read);
-		playtime = ctx->synchro.time + (((s32_t)(curframe->rtptime - ctx->synchro.rtp)) * 1000) / RAOP_SAMPLE_RATE;
+		playtime = rtp_playtime(ctx, curframe->rtptime);
 
 		if (now > playtime) {
 			LOG_DEBUG("[%p]: discarded frame now:%u missed by:%d (W:%hu R:%hu)", ctx, now, now - playtime, ctx->ab_write, ctx->ab_read);
 			ctx->discarded++;
 			curframe->ready = 0;
 		} else if (curframe->ready) {
-			ctx->data_cb((const u8_t*) curframe->data, curframe->len, playtime);
+			int outsize;
+			
+			// slot is decoded in place, receiver will not use it meanwhile
+			ctx->decoding = curframe;
+			ctx->pushing = true;
 			curframe->ready = 0;
-		} else if (playtime - now <= hold) {
+			ctx->ab_read++;
+			ctx->out_frames++;
+			
+			pthread_mutex_unlock(&ctx->ab_mutex);
+			alac_decode(ctx, ctx->pcm_buf, curframe->payload, curframe->len, &outsize);
+#ifdef __RTP_STORE
+			fwrite(ctx->pcm_buf, outsize, 1, ctx->rtpOUT);
+#endif
+			ctx->data_cb((const u8_t*) ctx->pcm_buf, outsize, playtime);
+			pthread_mutex_lock(&ctx->ab_mutex);
+			ctx->decoding = NULL;
+			ctx->pushing = false;
+			pthread_cond_signal(&ctx->push_cond);
+
+			// callback might have blocked
+			now = gettime_ms();
+			continue;
+		} else if (playtime - now <= hold || seq_order(ctx->jb.depth, ctx->ab_write - ctx->ab_read)) {
+			// missing for longer than playout depth or about to be due
 			LOG_DEBUG("[%p]: created zero frame (W:%hu R:%hu)", ctx, ctx->ab_write, ctx->ab_read);
-			ctx->data_cb(silence_frame, ctx->frame_size * 4, playtime);
+			ctx->ab_read++;
+			ctx->out_frames++;
 			ctx->silent_frames++;
+			ctx->pushing = true;
+
+			pthread_mutex_unlock(&ctx->ab_mutex);
+			ctx->data_cb(silence_frame, ctx->frame_size * 4, playtime);
+			pthread_mutex_lock(&ctx->ab_mutex);
+			ctx->pushing = false;
+			pthread_cond_signal(&ctx->push_cond);
+
+			now = gettime_ms();
+			continue;
 		} else break;
 
 		ctx->ab_read++;
 		ctx->out_frames++;
-
-	} while (seq_order(ctx->ab_read, ctx->ab_write));
+	}
 
 	if (ctx->out_frames > 1000) {
-		LOG_INFO("[%p]: drain [level:%hd head:%d ms] [W:%hu R:%hu] [req:%u sil:%u dis:%u]",
-				ctx, ctx->ab_write - ctx->ab_read, playtime - now, ctx->ab_write, ctx->ab_read,
-				ctx->resent_req, ctx->silent_frames, ctx->discarded);
+		LOG_INFO("[%p]: drain [level:%hd depth:%d head:%d ms] [W:%hu R:%hu] [req:%u rec:%u lost:%u late:%u dis:%u] [skew:%d ppm offset:%d us]",
+				ctx, ctx->ab_write - ctx->ab_read, ctx->jb.depth, playtime - now, ctx->ab_write, ctx->ab_read,
+				ctx->resent_req, ctx->resent_rec, ctx->silent_frames, ctx->jb.late, ctx->discarded, ctx->timing.skew, ctx->timing.offset);
 		ctx->out_frames = 0;
 	}
 
-	LOG_SDEBUG("playtime %u %d [W:%hu R:%hu] %d", playtime, playtime - now, ctx->ab_write, ctx->ab_read, curframe->ready);
+	LOG_SDEBUG("playtime %u %d [W:%hu R:%hu]", playtime, playtime - now, ctx->ab_write, ctx->ab_read);
+
+	buffer_resend(ctx, now, hold);
+}
+
+/*---------------------------------------------------------------------------*/
+// re-request missing packets every RESEND_TO as long as an answer can make it before 
+// they are replaced by silence. Contiguous packets are coalesced in one request
+static void buffer_resend(rtp_t *ctx, u32_t now, u32_t hold) {
+	seq_t i, first = 0;
+	int count = 0;
+
+	for (i = ctx->ab_read; seq_order(i, ctx->ab_write); i++) {
+		abuf_t *frame = ctx->audio_buffer + BUFIDX(i);
 
-	// each missing packet will be requested up to (latency_frames / 16) times
-	for (i = 0; seq_order(ctx->ab_read + i, ctx->ab_write); i += 16) {
-		abuf_t *frame = ctx->audio_buffer + BUFIDX(ctx->ab_read + i);
 		if (!frame->ready && now - frame->last_resend > RESEND_TO) {
-			rtp_request_resend(ctx, ctx->ab_read + i, ctx->ab_read + i);
-			frame->last_resend = now;
+			// silence comes when playtime is within hold or when more than depth newer packets are in
+			s32_t left = rtp_playtime(ctx, frame->rtptime) - now - hold;
+			s32_t depth = ((ctx->jb.depth - (seq_t) (ctx->ab_write - i)) * (s32_t) ctx->frame_size * 1000) / RAOP_SAMPLE_RATE;
+
+			if (min(left, depth) > RESEND_MIN) {
+				if (!count++) first = i;
+				frame->last_resend = now;
+				continue;
+			}
+		}
+
+		if (count) {
+			rtp_request_resend(ctx, first, first + count - 1);
+			count = 0;
 		}
 	}
-}
-
+
+	if (count) rtp_request_resend(ctx, first, first + count - 1);
+}
+
+/*---------------------------------------------------------------------------*/
+// decrypt, decode and push frames, so that network thread never waits for output
+static void *rtp_player_func(void *arg) {
+	rtp_t *ctx = (rtp_t*) arg;
+
+	pthread_mutex_lock(&ctx->ab_mutex);
+
+	while (ctx->running) {
+		struct timespec ts;
+		struct timeval now;
+
+		gettimeofday(&now, NULL);
+		ts.tv_sec = now.tv_sec;
+		ts.tv_nsec = (now.tv_usec + PLAYER_WAKEUP * 1000) * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		// woken up by new packets or periodically to replace missing ones
+		pthread_cond_timedwait(&ctx->ab_cond, &ctx->ab_mutex, &ts);
+		buffer_push_packet(ctx);
+	}
+
+	pthread_mutex_unlock(&ctx->ab_mutex);
+
+	LOG_INFO("[%p]: player terminating", ctx);
+
+#ifndef WIN32
+	xTaskNotifyGive(ctx->joiner);
+	vTaskDelete(NULL);
+#endif
+
+	return NULL;
+}
 
 /*---------------------------------------------------------------------------*/
 static void *rtp_thread_func(void *arg) {
@@ -584,52 +801,43 @@ static void *rtp_thread_func(void *arg) {
 		for (i = 0; i < 3; i++)
 			if (FD_ISSET(ctx->rtp_sockets[i].sock, &fds)) idx = i;
 
-		plen = recvfrom(ctx->rtp_sockets[idx].sock, packet, MAX_PACKET, 0, (struct sockaddr*) &ctx->rtp_host, &rtp_client_len);
-
 		if (!ntp_sent) {
 			LOG_WARN("[%p]: NTP request not send yet", ctx);
 			ntp_sent = rtp_request_timing(ctx);
 		}
 
+		// only peek header, audio packets (0x60 or resent 0x56) are then received in their slot
+		plen = recvfrom(ctx->rtp_sockets[idx].sock, packet, 16, MSG_PEEK, (struct sockaddr*) &ctx->rtp_host, &rtp_client_len);
+#ifdef WIN32
+		// winsock reports truncated peeks as an error
+		if (plen < 0 && last_error() == WSAEMSGSIZE) plen = 16;
+#endif
 		if (plen < 0) continue;
-		assert(plen <= MAX_PACKET);
 
 		type = packet[1] & ~0x80;
-		pktp = packet;
-
-		switch (type) {
-			seq_t seqno;
-			unsigned rtptime;
 
-			// re-sent packet
-			case 0x56: {
-				pktp += 4;
-				plen -= 4;
-			}
-
-			// data packet
-			case 0x60: {
-				seqno = ntohs(*(u16_t*)(pktp+2));
-				rtptime = ntohl(*(u32_t*)(pktp+4));
+		if (idx != TIMING && plen == 16 && (type == 0x60 || type == 0x56)) {
+			int offset = type == 0x56 ? 4 : 0;
+			seq_t seqno = ntohs(*(u16_t*)(packet+offset+2));
+			unsigned rtptime = ntohl(*(u32_t*)(packet+offset+4));
 
-				// adjust pointer and length
-				pktp += 12;
-				plen -= 12;
+			LOG_SDEBUG("[%p]: seqno:%hu rtp:%u (type: %x, first: %u)", ctx, seqno, rtptime, type, packet[1] & 0x80);
 
-				LOG_SDEBUG("[%p]: seqno:%hu rtp:%u (type: %x, first: %u)", ctx, seqno, rtptime, type, packet[1] & 0x80);
-
-				// check if packet contains enough content to be reasonable
-				if (plen < 16) break;
+			if ((packet[1] & 0x80) && (type != 0x56)) {
+				LOG_INFO("[%p]: 1st audio packet received", ctx);
+			}
 
-				if ((packet[1] & 0x80) && (type != 0x56)) {
-					LOG_INFO("[%p]: 1st audio packet received", ctx);
-				}
+			buffer_put_packet(ctx, ctx->rtp_sockets[idx].sock, seqno, rtptime, packet[1] & 0x80, offset + 12, packet);
+			continue;
+		}
 
-				buffer_put_packet(ctx, seqno, rtptime, packet[1] & 0x80, pktp, plen);
+		plen = recvfrom(ctx->rtp_sockets[idx].sock, packet, MAX_PACKET, 0, NULL, NULL);
+		if (plen < 0) continue;
+		assert(plen <= MAX_PACKET);
 
-				break;
-			}
+		pktp = packet;
 
+		switch (type) {
 			// sync packet
 			case 0x54: {
 				u32_t rtp_now_latency = ntohl(*(u32_t*)(pktp+4));
@@ -645,7 +853,7 @@ static void *rtp_thread_func(void *arg) {
 				if (ctx->latency < MIN_LATENCY) ctx->latency = MIN_LATENCY;
 				else if (ctx->latency > MAX_LATENCY) ctx->latency = MAX_LATENCY;
 				ctx->synchro.rtp = rtp_now - ctx->latency;
-				ctx->synchro.time = ctx->timing.local + (u32_t) NTP2MS(remote - ctx->timing.remote);
+				ctx->synchro.time = timing_remote2local(ctx, remote);
 
 				// now we are synced on RTP frames
 				ctx->synchro.status |= RTP_SYNC;
@@ -672,7 +880,6 @@ static void *rtp_thread_func(void *arg) {
 
 			// NTP timing packet
 			case 0x53: {
-				u64_t expected;
 				u32_t reference   = ntohl(*(u32_t*)(pktp+12)); // only low 32 bits in our case
 				u64_t remote 	  =(((u64_t) ntohl(*(u32_t*)(pktp+16))) << 32) + ntohl(*(u32_t*)(pktp+20));
 				u32_t roundtrip   = gettime_ms() - reference;
@@ -680,24 +887,21 @@ static void *rtp_thread_func(void *arg) {
 				// better discard sync packets when roundtrip is suspicious
 				if (roundtrip > 100) {
 					LOG_WARN("[%p]: discarding NTP roundtrip of %u ms", ctx, roundtrip);
+					ctx->timing.discarded++;
 					break;
 				}
 
-				/*
-				  The expected elapsed remote time should be exactly the same as
-				  elapsed local time between the two request, corrected by the
-				  drifting
-				*/
-				expected = ctx->timing.remote + MS2NTP(reference - ctx->timing.local);
-
-				ctx->timing.remote = remote;
-				ctx->timing.local = reference;
+				// remote stamped its receive time about half-way
+				pthread_mutex_lock(&ctx->ab_mutex);
+				timing_add_sample(ctx, reference + roundtrip / 2, remote, roundtrip);
+				pthread_mutex_unlock(&ctx->ab_mutex);
 
-				// now we are synced on NTP (mutex not needed)
+				// now we are synced on NTP
 				ctx->synchro.status |= NTP_SYNC;
 
-				LOG_DEBUG("[%p]: Timing references local:%llu, remote:%llx (delta:%lld, sum:%lld, adjust:%lld, gaps:%d)",
-						  ctx, ctx->timing.local, ctx->timing.remote);
+				LOG_DEBUG("[%p]: Timing references local:%llu, remote:%llx (rtt:%u, skew:%d ppm, offset:%d us, samples:%d, discarded:%u)",
+						  ctx, ctx->timing.local, ctx->timing.remote, roundtrip, ctx->timing.skew, ctx->timing.offset,
+						  ctx->timing.count, ctx->timing.discarded);
 
 				break;
 			}
@@ -708,13 +912,87 @@ static void *rtp_thread_func(void *arg) {
 	LOG_INFO("[%p]: terminating", ctx);
 
 #ifndef WIN32
-	xTaskNotify(ctx->joiner, 0, eNoAction);
+	xTaskNotifyGive(ctx->joiner);
 	vTaskDelete(NULL);
 #endif
 
 	return NULL;
 }
 
+/*---------------------------------------------------------------------------*/
+// add a timing sample and update the least-square fit of remote vs local time
+static void timing_add_sample(rtp_t *ctx, u32_t local, u64_t remote, u32_t rtt) {
+	struct timing_s *t = &ctx->timing;
+	double sxx = 0, sxy = 0;
+	u32_t min_rtt = rtt;
+	int i, n = 0;
+
+	// samples with a roundtrip well above the recent best are less accurate, but the best
+	// is taken from all recent ones so that a lasting increase is eventually accepted
+	for (i = 0; i < t->rtt_count; i++) min_rtt = min(min_rtt, t->rtt[i]);
+	t->rtt[t->rtt_head] = rtt;
+	t->rtt_head = (t->rtt_head + 1) % NTP_RTT_WINDOW;
+	if (t->rtt_count < NTP_RTT_WINDOW) t->rtt_count++;
+
+	if (t->count >= NTP_MIN_FIT && rtt > 2 * min_rtt + 5) {
+		LOG_INFO("[%p]: discarding NTP roundtrip of %u ms (best %u)", ctx, rtt, min_rtt);
+		t->discarded++;
+		return;
+	}
+
+	t->samples[t->head].local = local;
+	t->samples[t->head].remote = remote;
+	t->head = (t->head + 1) % NTP_SAMPLES;
+	if (t->count < NTP_SAMPLES) t->count++;
+
+	t->local = local;
+	t->remote = remote;
+	t->local0 = local;
+	t->remote0 = remote;
+	t->mx = t->my = 0;
+
+	for (i = 0; i < t->count; i++) {
+		t->mx += (s32_t) (t->samples[i].local - local);
+		t->my += (s64_t) (t->samples[i].remote - remote) * 1000.0 / 4294967296.0;
+	}
+	t->mx /= t->count;
+	t->my /= t->count;
+
+	for (i = 0; i < t->count; i++) {
+		double dx = (s32_t) (t->samples[i].local - local) - t->mx;
+		double dy = (s64_t) (t->samples[i].remote - remote) * 1000.0 / 4294967296.0 - t->my;
+		sxx += dx * dx;
+		sxy += dx * dy;
+		n++;
+	}
+
+	t->slope = 1;
+	if (n >= NTP_MIN_FIT && sxx > 0) {
+		double skew = (sxy / sxx - 1) * 1000000;
+		if (fabs(skew) <= NTP_MAX_SKEW) t->slope = sxy / sxx;
+		else LOG_WARN("[%p]: unlikely NTP skew %.0f ppm", ctx, skew);
+	}
+
+	t->skew = (t->slope - 1) * 1000000;
+	t->offset = (t->my - t->slope * t->mx) * 1000;
+}
+
+/*---------------------------------------------------------------------------*/
+// local time (ms) when remote clock reaches a given NTP time
+static u32_t timing_remote2local(rtp_t *ctx, u64_t remote) {
+	struct timing_s *t = &ctx->timing;
+	double dy = (s64_t) (remote - t->remote0) * 1000.0 / 4294967296.0;
+
+	return t->local0 + (s32_t) floor(t->mx + (dy - t->my) / t->slope + 0.5);
+}
+
+/*---------------------------------------------------------------------------*/
+// local time (ms) to play a frame, remote elapsed time is corrected by skew
+static u32_t rtp_playtime(rtp_t *ctx, u32_t rtptime) {
+	s32_t elapsed = (((s32_t)(rtptime - ctx->synchro.rtp)) * 1000) / RAOP_SAMPLE_RATE;
+	return ctx->synchro.time + elapsed - ((s64_t) elapsed * ctx->timing.skew) / 1000000;
+}
+
 /*---------------------------------------------------------------------------*/
 static bool rtp_request_timing(rtp_t *ctx) {
 	unsigned char req[32];
@@ -752,9 +1030,10 @@ static bool rtp_request_timing(rtp_t *ctx) {
 /*---------------------------------------------------------------------------*/
 static bool rtp_request_resend(rtp_t *ctx, seq_t first, seq_t last) {
 	unsigned char req[8];    // *not* a standard RTCP NACK
+	struct sockaddr_in host;
 
 	// do not request silly ranges (happens in case of network large blackouts)
-	if (seq_order(last, first) || last - first > BUFFER_FRAMES / 2) return false;
+	if (seq_order(last, first) || last - first > JB_SLOTS / 2) return false;
 	
 	ctx->resent_req += last - first + 1;
 
@@ -766,9 +1045,11 @@ static bool rtp_request_resend(rtp_t *ctx, seq_t first, seq_t last) {
 	*(u16_t*)(req+4) = htons(first);  // missed seqnum
 	*(u16_t*)(req+6) = htons(last-first+1);  // count
 
-	ctx->rtp_host.sin_port = htons(ctx->rtp_sockets[CONTROL].rport);
+	// called from player while rtp thread receives in rtp_host
+	host = ctx->rtp_host;
+	host.sin_port = htons(ctx->rtp_sockets[CONTROL].rport);
 
-	if (sizeof(req) != sendto(ctx->rtp_sockets[CONTROL].sock, req, sizeof(req), 0, (struct sockaddr*) &ctx->rtp_host, sizeof(ctx->rtp_host))) {
+	if (sizeof(req) != sendto(ctx->rtp_sockets[CONTROL].sock, req, sizeof(req), 0, (struct sockaddr*) &host, sizeof(host))) {
 		LOG_WARN("[%p]: SENDTO failed (%s)", ctx, strerror(errno));
 	}
 
@@ -352,7 +352,7 @@ static decode_state alac_decode(void) {
 	block_size = l->default_block_size ? l->default_block_size : l->block_size[l->block_index];
 
 	// stream terminated
-	if (stream.state <= DISCONNECT && (bytes == 0 || block_size == 0)) {
+	if (_stream_ended() && (bytes == 0 || block_size == 0)) {
 		UNLOCK_S;
 		LOG_DEBUG("end of stream");
 		return DECODE_COMPLETE;
@@ -364,25 +364,19 @@ static decode_state alac_decode(void) {
 		return DECODE_RUNNING;
 	} else if (block_size != l->default_block_size) l->block_index++;
 
-	bytes = min(bytes, _buf_cont_read(streambuf));
-
-	// need to create a buffer with contiguous data
-	if (bytes < block_size) {
-		u8_t *buffer = malloc(block_size);
-		memcpy(buffer, streambuf->readp, bytes);
-		memcpy(buffer + bytes, streambuf->buf, block_size - bytes);
-		iptr = buffer;
-	} else iptr = streambuf->readp;
+	// blocks wrapping round end of streambuf are contiguous thanks to its mirrored tail
+	if (_buf_cont_read(streambuf) < block_size) {
+		LOG_ERROR("block of %u bytes larger than streambuf tail", block_size);
+		UNLOCK_S;
+		return DECODE_ERROR;
+	}
 
-	if (!alac_to_pcm(l->decoder, iptr, l->writebuf, 2, &frames)) {
+	if (!alac_to_pcm(l->decoder, streambuf->readp, l->writebuf, 2, &frames)) {
 		LOG_ERROR("decode error");
 		UNLOCK_S;
 		return DECODE_ERROR;
 	}
 
-	// and free it
-	if (bytes < block_size) free(iptr);
-
 	LOG_SDEBUG("block of %u bytes (%u frames)", block_size, frames);
 
 	endstream = false;
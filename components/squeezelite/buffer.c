@@ -27,33 +27,72 @@
 
 // _* called with muxtex locked
 
+/*
+ Each index is only moved by its owner (writep by the producer, readp by the
+ consumer) and always in a single store, so with acquire/release accesses the
+ occupancy can be read without the mutex when there is a single producer and a
+ single consumer. The mutex is still required for flush, resize and adjust.
+*/
+#define LOAD_P(p)     __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE_P(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
 inline unsigned _buf_used(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->writep - buf->readp : buf->size - (buf->readp - buf->writep);
+	u8_t *readp = LOAD_P(buf->readp), *writep = LOAD_P(buf->writep);
+	return writep >= readp ? writep - readp : buf->size - (readp - writep);
 }
 
 unsigned _buf_space(struct buffer *buf) {
 	return buf->size - _buf_used(buf) - 1; // reduce by one as full same as empty otherwise
 }
 
+// when a tail is set, the head of the buffer is mirrored after wrap so reads can cross it
 unsigned _buf_cont_read(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->writep - buf->readp : buf->wrap - buf->readp;
+	u8_t *readp = LOAD_P(buf->readp), *writep = LOAD_P(buf->writep);
+	if (writep >= readp) return writep - readp;
+	return buf->wrap - readp + min((size_t) (writep - buf->buf), buf->tail);
 }
 
 unsigned _buf_cont_write(struct buffer *buf) {
-	return buf->writep >= buf->readp ? buf->wrap - buf->writep : buf->readp - buf->writep;
+	u8_t *readp = LOAD_P(buf->readp), *writep = LOAD_P(buf->writep);
+	return writep >= readp ? buf->wrap - writep : readp - writep;
 }
 
 void _buf_inc_readp(struct buffer *buf, unsigned by) {
-	buf->readp += by;
-	if (buf->readp >= buf->wrap) {
-		buf->readp -= buf->size;
+	u8_t *readp = buf->readp + by;
+	if (readp >= buf->wrap) {
+		readp -= buf->size;
+	}
+	STORE_P(buf->readp, readp);
+	if (buf->space_wait && _buf_space(buf) > buf->space_low) {
+		cond_signal(buf->space_cond);
 	}
 }
 
 void _buf_inc_writep(struct buffer *buf, unsigned by) {
-	buf->writep += by;
-	if (buf->writep >= buf->wrap) {
-		buf->writep -= buf->size;
+	u8_t *writep = buf->writep;
+	// update mirror before making new data visible to the consumer
+	if (writep < buf->buf + buf->tail) {
+		memcpy(buf->wrap + (writep - buf->buf), writep, min((size_t) by, (size_t) (buf->buf + buf->tail - writep)));
+	}
+	writep += by;
+	if (writep >= buf->wrap) {
+		writep -= buf->size;
+	}
+	STORE_P(buf->writep, writep);
+}
+
+// called with mutex locked, wait until space is above low or until woken/timeout
+void _buf_wait_space(struct buffer *buf, unsigned low, unsigned ms) {
+	buf->space_low = low;
+	buf->space_wait = true;
+	cond_timedwait_ms(buf->space_cond, buf->mutex, ms);
+	buf->space_wait = false;
+}
+
+// called with mutex locked, release a producer waiting in _buf_wait_space
+void _buf_wake(struct buffer *buf) {
+	if (buf->space_wait) {
+		cond_signal(buf->space_cond);
 	}
 }
 
@@ -61,18 +100,25 @@ void buf_flush(struct buffer *buf) {
 	mutex_lock(buf->mutex);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
+	_buf_wake(buf);
 	mutex_unlock(buf->mutex);
 }
 
 void _buf_flush(struct buffer *buf) {
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
+	_buf_wake(buf);
 }
 
 // adjust buffer to multiple of mod bytes so reading in multiple always wraps on frame boundary
+// contents are kept when not empty (prefetched stream), frames across wrap are then read thanks to the tail
 void buf_adjust(struct buffer *buf, size_t mod) {
 	size_t size;
 	mutex_lock(buf->mutex);
+	if (_buf_used(buf)) {
+		mutex_unlock(buf->mutex);
+		return;
+	}
 	size = ((unsigned)(buf->base_size / mod)) * mod;
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
@@ -85,10 +131,10 @@ void buf_adjust(struct buffer *buf, size_t mod) {
 void _buf_resize(struct buffer *buf, size_t size) {
 	if (size == buf->size) return;
 	free(buf->buf);
-	buf->buf = malloc(size);
+	buf->buf = malloc(size + buf->tail);
 	if (!buf->buf) {
 		size    = buf->size;
-		buf->buf= malloc(size);
+		buf->buf= malloc(size + buf->tail);
 		if (!buf->buf) {
 			size = 0;
 		}
@@ -100,14 +146,40 @@ void _buf_resize(struct buffer *buf, size_t size) {
 	buf->base_size = size;
 }
 
-void buf_init(struct buffer *buf, size_t size) {
-	buf->buf    = malloc(size);
+// exchange storage and content, but not mutex and condition
+void _buf_swap(struct buffer *a, struct buffer *b) {
+	struct buffer tmp = *a;
+	
+	a->buf = b->buf;
+	a->readp = b->readp;
+	a->writep = b->writep;
+	a->wrap = b->wrap;
+	a->size = b->size;
+	a->base_size = b->base_size;
+	a->tail = b->tail;
+	
+	b->buf = tmp.buf;
+	b->readp = tmp.readp;
+	b->writep = tmp.writep;
+	b->wrap = tmp.wrap;
+	b->size = tmp.size;
+	b->base_size = tmp.base_size;
+	b->tail = tmp.tail;
+}
+
+// tail is an optional guard after wrap, mirroring the head, so that _buf_cont_read 
+// always returns at least min(tail, _buf_used) bytes
+void buf_init(struct buffer *buf, size_t size, size_t tail) {
+	buf->buf    = malloc(size + tail);
 	buf->readp  = buf->buf;
 	buf->writep = buf->buf;
 	buf->wrap   = buf->buf + size;
 	buf->size   = size;
 	buf->base_size = size;
+	buf->tail   = tail;
+	buf->space_wait = false;
 	mutex_create_p(buf->mutex);
+	cond_create(buf->space_cond);
 }
 
 void buf_destroy(struct buffer *buf) {
@@ -117,5 +189,6 @@ void buf_destroy(struct buffer *buf) {
 		buf->size = 0;
 		buf->base_size = 0;
 		mutex_destroy(buf->mutex);
+		cond_destroy(buf->space_cond);
 	}
 }
@@ -35,6 +35,29 @@ struct decodestate decode;
 struct codec *codecs[MAX_CODECS];
 struct codec *codec;
 static bool running = true;
+static u32_t open_time;
+
+#define WAKE_TIMEOUT 100
+
+// decoder waits here until stream or output moved past what it needs (0 = not waiting)
+static struct {
+	mutex_type mutex;
+	cond_type cond;
+	bool pending;
+	unsigned min_bytes, min_space;
+} wake;
+
+// codec and track settings of prefetched stream, used once current one completes
+static struct {
+	bool pending, track;
+	u8_t format, sample_size, sample_rate, channels, endianness;
+	u32_t replay_gain;
+	u8_t fade_mode, fade_secs;
+	bool invert;
+} next_codec;
+
+static void _codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
+static void _output_track(u32_t replay_gain, u8_t fade_mode, u8_t fade_secs, bool invert);
 
 #define LOCK_S   mutex_lock(streambuf->mutex)
 #define UNLOCK_S mutex_unlock(streambuf->mutex)
@@ -53,20 +76,38 @@ static bool running = true;
 #define MAY_PROCESS(x)
 #endif
 
+static void decode_wait(unsigned min_bytes, unsigned min_space) {
+	mutex_lock(wake.mutex);
+	
+	__atomic_store_n(&wake.min_bytes, min_bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&wake.min_space, min_space, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// re-check after publishing thresholds, a producer might have missed them
+	if (!wake.pending && (!min_bytes || _buf_used(streambuf) <= min_bytes) && 
+		(!min_space || _buf_space(outputbuf) <= min_space)) {
+		cond_timedwait_ms(wake.cond, wake.mutex, WAKE_TIMEOUT);
+	}
+	
+	wake.pending = false;
+	wake.min_bytes = wake.min_space = 0;
+	mutex_unlock(wake.mutex);
+}
+
 static void *decode_thread() {
 	
 	while (running) {
-		size_t bytes, space, min_space;
+		size_t bytes, space, min_space = 0;
 		bool toend;
 		bool ran = false;
 		
+		// state and occupancy must be consistent as a flush could happen between them
 		LOCK_S;
 		bytes = _buf_used(streambuf);
-		toend = (stream.state <= DISCONNECT);
+		toend = _stream_ended();
 		UNLOCK_S;
-		LOCK_O;
+		// we are the only producer of outputbuf, a flush only frees space so a stale value just delays us
 		space = _buf_space(outputbuf);
-		UNLOCK_O;
 
 		LOCK_D;
 		
@@ -82,9 +123,14 @@ static void *decode_thread() {
 			);
 
 			if (space > min_space && (bytes > codec->min_read_bytes || toend)) {
+				bool new_stream = decode.new_stream;
 				
 				decode.state = codec->decode();
 
+				if (new_stream && !decode.new_stream) {
+					LOG_INFO("first frames decoded %u ms after codec open", gettime_ms() - open_time);
+				}
+
 				IF_PROCESS(
 					if (process.in_frames) {
 						process_samples();
@@ -103,6 +149,26 @@ static void *decode_thread() {
 					if (output.fade_mode) _checkfade(false);
 					UNLOCK_O;
 
+					// next stream is prefetched, move on to it without waiting for controller
+					if (decode.state == DECODE_COMPLETE && stream.prefetch) {
+						LOCK_S;
+						_stream_swap();
+						UNLOCK_S;
+						if (next_codec.pending) {
+							next_codec.pending = false;
+							if (next_codec.track) {
+								next_codec.track = false;
+								LOCK_O;
+								_output_track(next_codec.replay_gain, next_codec.fade_mode, next_codec.fade_secs, next_codec.invert);
+								UNLOCK_O;
+							}	
+							_codec_open(next_codec.format, next_codec.sample_size, next_codec.sample_rate, 
+										next_codec.channels, next_codec.endianness);
+						} else {
+							decode.state = DECODE_STOPPED;
+						}
+					}
+
 					wake_controller();
 				}
 
@@ -113,7 +179,13 @@ static void *decode_thread() {
 		UNLOCK_D;
 
 		if (!ran) {
-			usleep(100000);
+			// only wait for what is missing, or for a state change when not running
+			if (decode.state == DECODE_RUNNING && codec) {
+				decode_wait(bytes > codec->min_read_bytes || toend ? 0 : codec->min_read_bytes, 
+							space > min_space ? 0 : min_space);
+			} else {
+				decode_wait(0, 0);
+			}	
 		}
 	}
 	
@@ -210,6 +282,8 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 	LOG_DEBUG("include codecs: %s exclude codecs: %s", include_codecs ? include_codecs : "", exclude_codecs);
 
 	mutex_create(decode.mutex);
+	mutex_create(wake.mutex);
+	cond_create(wake.cond);
 
 #if LINUX || OSX || FREEBSD || EMBEDDED
 	pthread_attr_t attr;
@@ -243,15 +317,19 @@ void decode_close(void) {
 	running = false;
 	UNLOCK_D;
 #if LINUX || OSX || FREEBSD || EMBEDDED
+	decode_wake();
 	pthread_join(thread, NULL);
 #endif
 	mutex_destroy(decode.mutex);
+	mutex_destroy(wake.mutex);
+	cond_destroy(wake.cond);
 }
 
 void decode_flush(void) {
 	LOG_INFO("decode flush");
 	LOCK_D;
 	decode.state = DECODE_STOPPED;
+	next_codec.pending = next_codec.track = false;
 	IF_PROCESS(
 		process_flush();
 	);
@@ -274,13 +352,93 @@ unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) {
 	return sample_rate;
 }
 
+// wake decoder unconditionally (state change)
+void decode_wake(void) {
+	mutex_lock(wake.mutex);
+	wake.pending = true;
+	cond_signal(wake.cond);
+	mutex_unlock(wake.mutex);
+}
+
+// called by stream producer after new data, only wakes if that satisfies decoder
+void decode_wake_bytes(unsigned bytes) {
+	unsigned min_bytes;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	min_bytes = __atomic_load_n(&wake.min_bytes, __ATOMIC_RELAXED);
+	if (min_bytes && bytes > min_bytes) decode_wake();
+}
+
+// called by output consumer after freeing space, only wakes if that satisfies decoder
+void decode_wake_space(unsigned space) {
+	unsigned min_space;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	min_space = __atomic_load_n(&wake.min_space, __ATOMIC_RELAXED);
+	if (min_space && space > min_space) decode_wake();
+}
+
 void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
-	int i;
+	LOCK_D;
+	LOCK_S;
+	
+	// stream is prefetched, so defer opening until current one is decoded
+	if (stream.prefetch) {
+		if (decode.state == DECODE_RUNNING) {
+			LOG_INFO("codec open deferred: '%c'", format);
+			next_codec.pending = true;
+			next_codec.format = format;
+			next_codec.sample_size = sample_size;
+			next_codec.sample_rate = sample_rate;
+			next_codec.channels = channels;
+			next_codec.endianness = endianness;
+			UNLOCK_S;
+			UNLOCK_D;
+			return;
+		}
+		_stream_swap();
+	}
+	
+	UNLOCK_S;
+	
+	_codec_open(format, sample_size, sample_rate, channels, endianness);
+	
+	UNLOCK_D;
+}
 
-	LOG_INFO("codec open: '%c'", format);
+// called with outputbuf locked
+static void _output_track(u32_t replay_gain, u8_t fade_mode, u8_t fade_secs, bool invert) {
+	output.next_replay_gain = replay_gain;
+	output.fade_mode = fade_mode;
+	output.fade_secs = fade_secs;
+	output.invert    = invert;
+	LOG_DEBUG("set fade mode: %u", output.fade_mode);
+}
 
+// track settings go with the codec, so they wait as well when it is deferred
+void codec_track(u32_t replay_gain, u8_t fade_mode, u8_t fade_secs, bool invert) {
 	LOCK_D;
+	
+	if (next_codec.pending) {
+		LOG_INFO("track settings deferred");
+		next_codec.track = true;
+		next_codec.replay_gain = replay_gain;
+		next_codec.fade_mode = fade_mode;
+		next_codec.fade_secs = fade_secs;
+		next_codec.invert = invert;
+	} else {
+		LOCK_O;
+		_output_track(replay_gain, fade_mode, fade_secs, invert);
+		UNLOCK_O;
+	}
+	
+	UNLOCK_D;
+}
+
+static void _codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness) {
+	int i;
 
+	LOG_INFO("codec open: '%c'", format);
+
+	open_time = gettime_ms();
 	decode.new_stream = true;
 	decode.state = DECODE_STOPPED;
 
@@ -304,13 +462,10 @@ void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels,
 
 			decode.state = DECODE_READY;
 
-			UNLOCK_D;
 			return;
 		}
 	}
 
-	UNLOCK_D;
-
 	LOG_ERROR("codec not found");
 }
 
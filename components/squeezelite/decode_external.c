@@ -36,55 +36,195 @@ extern log_level loglevel;
 
 #define RAOP_OUTPUT_SIZE (RAOP_SAMPLE_RATE * 2 * 2 * 2 * 1.2)
 
+// beyond that, drift resampler would take too long to catch-up so we skip/pause
+#define RAOP_MAX_DRIFT	20
+
+#define STAGE_SIZE		(32 * 1024)		// power of 2, 185 ms of 16 bits stereo at 44.1kHz
+#define STAGE_SPACE_LOW	(1024 * BYTES_PER_FRAME)	// wait for that much room in outputbuf
+#define STAGE_TIMEOUT	100				// ms, writer wait timeout (stats and safety)
+#ifndef STAGE_DROP_OLDEST
+#define STAGE_DROP_OLDEST	1			// on overflow, drop oldest (keeps latency) or newest data
+#endif
+#define WRITER_THREAD_STACK_SIZE	(3 * 1024)
+
 static raop_event_t	raop_state;
 static bool raop_expect_stop = false;
 static struct {
 	bool enabled, start;
 	s32_t error;
 	u32_t start_time;
-	u32_t playtime, len;
+	u32_t playtime, len;		// len of most recent block, in frames
+	struct drift *drift;
 } raop_sync;
 
 /****************************************************************************************
- * Common sink data handler
+ * Staging queue between sinks and outputbuf
+ 
+ Sinks callbacks run on network or BT stack tasks that must never wait for outputbuf, so 
+ they only copy to a lock-free single producer/single consumer ring. A writer thread moves 
+ it to outputbuf. When the ring is full, either the oldest or the newest data is dropped: 
+ producer can move the tail (with a CAS), and the writer only commits what it has read 
+ if the tail did not move meanwhile.
  */
-static void sink_data_handler(const uint8_t *data, uint32_t len)
-{
-    size_t bytes, space;
-		
-	// would be better to lock decoder, but really, it does not matter
-	if (decode.state != DECODE_STOPPED) {
-		LOG_SDEBUG("Cannot use external sink while LMS is controlling player");
-		return;
-	} 
+static struct {
+	u8_t *buf;
+	u32_t head, tail;		// free running, in bytes
+	u32_t dropped, overflows, max_used;
+	struct drift *drift;	// set by producer when data must be resampled
+	mutex_type mutex;		// only for writer to wait for data
+	cond_type cond;
+	bool wait;
+} stage;
+
+static bool writer_running;
+static thread_type writer_thread;
+
+static inline u32_t stage_used(void) {
+	return __atomic_load_n(&stage.head, __ATOMIC_ACQUIRE) - __atomic_load_n(&stage.tail, __ATOMIC_ACQUIRE);
+}
+
+// producer side, never blocks
+static void stage_put(const u8_t *data, u32_t len) {
+	u32_t head = stage.head, offset, n;
+
+	len &= ~3;
+	if (len > STAGE_SIZE) {
+		stage.dropped += len - STAGE_SIZE;
+		data += len - STAGE_SIZE;
+		len = STAGE_SIZE;
+	}
+
+	while (1) {
+		u32_t tail = __atomic_load_n(&stage.tail, __ATOMIC_ACQUIRE);
+		u32_t space = STAGE_SIZE - (head - tail);
+
+		if (space >= len) break;
+
+		if (!STAGE_DROP_OLDEST) {
+			stage.dropped += len;
+			stage.overflows++;
+			return;
+		}
+
+		if (__atomic_compare_exchange_n(&stage.tail, &tail, tail + len - space, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			stage.dropped += len - space;
+			stage.overflows++;
+			break;
+		}
+	}
+
+	offset = head & (STAGE_SIZE - 1);
+	n = min(len, STAGE_SIZE - offset);
+	memcpy(stage.buf + offset, data, n);
+	memcpy(stage.buf, data + n, len - n);
+
+	__atomic_store_n(&stage.head, head + len, __ATOMIC_RELEASE);
+	stage.max_used = max(stage.max_used, stage_used());
+
+	// only take the mutex when writer is idle, it never holds it for long
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&stage.wait, __ATOMIC_RELAXED)) {
+		mutex_lock(stage.mutex);
+		cond_signal(stage.cond);
+		mutex_unlock(stage.mutex);
+	}	
+}
+
+// consumer side, wait for the ring to be filled (or writer to be stopped)
+static void stage_wait(void) {
+	mutex_lock(stage.mutex);
+	__atomic_store_n(&stage.wait, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!stage_used() && writer_running) cond_timedwait_ms(stage.cond, stage.mutex, STAGE_TIMEOUT);
+	__atomic_store_n(&stage.wait, false, __ATOMIC_RELAXED);
+	mutex_unlock(stage.mutex);
+}
+
+// called with outputbuf locked (so that flush is atomic with outputbuf's)
+static void _stage_flush(void) {
+	u32_t tail = __atomic_load_n(&stage.tail, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&stage.tail, &tail, __atomic_load_n(&stage.head, __ATOMIC_ACQUIRE), 
+										false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// consumer side, move what fits from the ring to outputbuf, returns false if nothing was done
+static bool _stage_move(void) {
+	u32_t tail = __atomic_load_n(&stage.tail, __ATOMIC_ACQUIRE);
+	u32_t used = __atomic_load_n(&stage.head, __ATOMIC_ACQUIRE) - tail;
+	u32_t offset = tail & (STAGE_SIZE - 1);
+	s16_t *iptr = (s16_t*) (stage.buf + offset);
+	frames_t frames = min(used, STAGE_SIZE - offset) / 4;
+	frames_t space = min(_buf_space(outputbuf), _buf_cont_write(outputbuf)) / BYTES_PER_FRAME;
+	frames_t produced, consumed;
 	
-	// there will always be room at some point
-	while (len) {
-		LOCK_O;
+	if (!frames || !space) return false;
 
-		bytes = min(_buf_space(outputbuf), _buf_cont_write(outputbuf));
-		bytes = min(len, bytes);
+	// AirPlay is resampled to correct drift, length changes slightly
+	if (stage.drift) {
+		produced = drift_resample16(stage.drift, iptr, frames, (ISAMPLE_T*) outputbuf->writep, space, &consumed);
+	} else {
+		produced = consumed = min(frames, space);
 #if BYTES_PER_FRAME == 4
-		memcpy(outputbuf->writep, data, bytes);
+		memcpy(outputbuf->writep, iptr, consumed * BYTES_PER_FRAME);
 #else
 		{
-			s16_t *iptr = (s16_t*) data;
 			ISAMPLE_T *optr = (ISAMPLE_T*) outputbuf->writep;
-			size_t n = bytes / BYTES_PER_FRAME * 2;
+			size_t n = consumed * 2;
 			while (n--) *optr++ = *iptr++ << 16;
 		}
 #endif	
-		_buf_inc_writep(outputbuf, bytes);
-		space = _buf_space(outputbuf);
-		
-		len -= bytes;
-		data += bytes;
-				
-		UNLOCK_O;
-		
-		// allow i2s to empty the buffer if needed
-		if (len && !space) usleep(50000);
-	}	
+	}
+
+	// producer has dropped what we were reading (resampler history is lost, just a glitch)
+	if (!__atomic_compare_exchange_n(&stage.tail, &tail, tail + consumed * 4, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return true;
+
+	_buf_inc_writep(outputbuf, produced * BYTES_PER_FRAME);
+
+	return true;
+}
+
+static void *writer_thread_func(void *arg) {
+	u32_t stats = gettime_ms(), dropped = 0;
+
+	while (writer_running) {
+		// empty ring, no need to bother outputbuf
+		if (!stage_used()) {
+			stage_wait();
+		} else {
+			LOCK_O;
+			// full outputbuf, output releases us when there is room
+			if (!_stage_move() && writer_running) _buf_wait_space(outputbuf, STAGE_SPACE_LOW, STAGE_TIMEOUT);
+			UNLOCK_O;
+		}	
+
+		if (stage.dropped != dropped && gettime_ms() - stats > 1000) {
+			LOG_INFO("staging [used:%u max:%u] [dropped:%u bytes, overflows:%u]", stage_used(), stage.max_used, stage.dropped, stage.overflows);
+			dropped = stage.dropped;
+			stats = gettime_ms();
+		}
+	}
+
+	return NULL;
+}
+
+/****************************************************************************************
+ * Common sink data handler
+ */
+static void _sink_data_handler(const uint8_t *data, uint32_t len, struct drift *drift)
+{
+	// would be better to lock decoder, but really, it does not matter
+	if (decode.state != DECODE_STOPPED) {
+		LOG_SDEBUG("Cannot use external sink while LMS is controlling player");
+		return;
+	} 
+	
+	stage.drift = drift;
+	stage_put(data, len);
+}
+
+static void sink_data_handler(const uint8_t *data, uint32_t len)
+{
+	_sink_data_handler(data, len, NULL);
 }
 
 /****************************************************************************************
@@ -123,6 +263,7 @@ static void bt_sink_cmd_handler(bt_sink_cmd_t cmd, ...)
 		break;
 	case BT_SINK_STOP:		
 		_buf_flush(outputbuf);
+		_stage_flush();
 	case BT_SINK_PAUSE:		
 		output.state = OUTPUT_STOPPED;
 		LOG_INFO("BT sink stopped");
@@ -151,9 +292,9 @@ static void bt_sink_cmd_handler(bt_sink_cmd_t cmd, ...)
 static void raop_sink_data_handler(const uint8_t *data, uint32_t len, u32_t playtime) {
 	
 	raop_sync.playtime = playtime;
-	raop_sync.len = len;
+	raop_sync.len = len / 4;
 
-	sink_data_handler(data, len);
+	_sink_data_handler(data, len, raop_sync.enabled ? raop_sync.drift : NULL);
 }	
 
 /****************************************************************************************
@@ -187,22 +328,28 @@ void raop_sink_cmd_handler(raop_event_t event, void *param)
 				LOG_DEBUG("backend played %u, desired %u, (delta:%d)", ms, now - raop_sync.start_time, error);
 				if (abs(error) < 10 && abs(raop_sync.error) < 10) raop_sync.start = false;
 			} else {	
-				// in how many ms will the most recent block play 
-				ms = ((u64_t) ((_buf_used(outputbuf) - raop_sync.len) / BYTES_PER_FRAME + output.device_frames + output.frames_in_process) * 1000) / RAOP_SAMPLE_RATE - (now - output.updated);
+				// in how many ms will the most recent block play (it might still be staged)
+				ms = ((u64_t) (_buf_used(outputbuf) / BYTES_PER_FRAME + stage_used() / 4 - raop_sync.len + output.device_frames + output.frames_in_process) * 1000) / RAOP_SAMPLE_RATE - (now - output.updated);
 				error = (raop_sync.playtime - now) - ms;
 				LOG_INFO("head local:%u, remote:%u (delta:%d)", ms, raop_sync.playtime - now, error);
-				LOG_DEBUG("obuf:%u, sync_len:%u, devframes:%u, inproc:%u", _buf_used(outputbuf), raop_sync.len, output.device_frames, output.frames_in_process);
+				LOG_DEBUG("obuf:%u, staged:%u, sync_len:%u, devframes:%u, inproc:%u", _buf_used(outputbuf), stage_used(), raop_sync.len, output.device_frames, output.frames_in_process);
 			}	
 			
-			if (error < -10 && raop_sync.error < -10) {
+			// small errors are slewed by resampling, large ones are jumped
+			if (raop_sync.drift && !raop_sync.start && abs(error) <= RAOP_MAX_DRIFT) {
+				drift_error(raop_sync.drift, error);
+				LOG_INFO("drift correction %d ppm", drift_ppm(raop_sync.drift));
+			} else if (error < -10 && raop_sync.error < -10) {
 				output.skip_frames = (abs(error + raop_sync.error) / 2 * RAOP_SAMPLE_RATE) / 1000;
 				output.state = OUTPUT_SKIP_FRAMES;					
 				raop_sync.error = 0;
+				if (raop_sync.drift) drift_reset(raop_sync.drift);
 				LOG_INFO("skipping %u frames", output.skip_frames);
 			} else if (error > 10 && raop_sync.error > 10) {
 				output.pause_frames = (abs(error + raop_sync.error) / 2 * RAOP_SAMPLE_RATE) / 1000;
 				output.state = OUTPUT_PAUSE_FRAMES;
 				raop_sync.error = 0;
+				if (raop_sync.drift) drift_reset(raop_sync.drift);
 				LOG_INFO("pausing for %u frames", output.pause_frames);
 			}
 				
@@ -219,6 +366,7 @@ void raop_sink_cmd_handler(raop_event_t event, void *param)
 			raop_sync.error = 0;
 			raop_sync.start = true;		
 			raop_sync.enabled = !strcasestr(output.device, "BT");
+			if (raop_sync.drift) drift_reset(raop_sync.drift);
 			output.external = true;
 			output.next_sample_rate = output.current_sample_rate = RAOP_SAMPLE_RATE;
 			output.state = OUTPUT_STOPPED;
@@ -235,6 +383,8 @@ void raop_sink_cmd_handler(raop_event_t event, void *param)
 			raop_expect_stop = true;
 			raop_state = event;
 			_buf_flush(outputbuf);		
+			_stage_flush();
+			if (raop_sync.drift) drift_reset(raop_sync.drift);
 			output.state = OUTPUT_STOPPED;
 			output.frames_played = 0;
 			break;
@@ -268,7 +418,61 @@ void raop_sink_cmd_handler(raop_event_t event, void *param)
 /****************************************************************************************
  * We provide the generic codec register option
  */
+static bool stage_create(void) {
+	stage.buf = malloc(STAGE_SIZE);
+	if (!stage.buf) {
+		LOG_ERROR("can't allocate staging buffer, external sinks disabled");
+		return false;
+	}
+
+	mutex_create(stage.mutex);
+	cond_create(stage.cond);
+	writer_running = true;
+
+#if LINUX || OSX || FREEBSD || EMBEDDED
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+#ifdef PTHREAD_STACK_MIN
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + WRITER_THREAD_STACK_SIZE);
+#endif
+	pthread_create_name(&writer_thread, &attr, writer_thread_func, NULL, "sink_writer");
+	pthread_attr_destroy(&attr);
+#endif
+
+	return true;
+}
+
+static void stage_delete(void) {
+	// wake writer wherever it waits
+	writer_running = false;
+	mutex_lock(stage.mutex);
+	cond_signal(stage.cond);
+	mutex_unlock(stage.mutex);
+	LOCK_O;
+	_buf_wake(outputbuf);
+	UNLOCK_O;
+	
+#if LINUX || OSX || FREEBSD || EMBEDDED
+	pthread_join(writer_thread, NULL);
+#endif
+	mutex_destroy(stage.mutex);
+	cond_destroy(stage.cond);
+	free(stage.buf);
+	stage.buf = NULL;
+}
+
 void register_external(void) {
+	bool sink = false;
+
+	// ring and writer are only needed when a sink can feed them
+#ifdef CONFIG_BT_SINK	
+	if (!strcasestr(output.device, "BT ")) sink = true;
+#endif	
+#ifdef CONFIG_AIRPLAY_SINK
+	sink = true;
+#endif
+	if (!sink || !stage_create()) return;
+
 #ifdef CONFIG_BT_SINK	
 	if (!strcasestr(output.device, "BT ")) {
 		bt_sink_init(bt_sink_cmd_handler, sink_data_handler);
@@ -278,12 +482,16 @@ void register_external(void) {
 	}	
 #endif	
 #ifdef CONFIG_AIRPLAY_SINK
+	raop_sync.drift = drift_create();
 	raop_sink_init(raop_sink_cmd_handler, raop_sink_data_handler);
 	LOG_INFO("Initializing AirPlay sink");		
 #endif
 }
 
 void deregister_external(void) {
+	// nothing was started
+	if (!stage.buf) return;
+	
 #ifdef CONFIG_BT_SINK	
 	if (!strcasestr(output.device, "BT ")) {
 		bt_sink_deinit();
@@ -294,4 +502,10 @@ void deregister_external(void) {
 	raop_sink_deinit();
 	LOG_INFO("Stopping AirPlay sink");		
 #endif
+
+	// sinks are stopped, writer can go (it uses drift resampler)
+	stage_delete();
+	
+	drift_delete(raop_sync.drift);
+	raop_sync.drift = NULL;
 }
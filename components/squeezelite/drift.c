@@ -0,0 +1,134 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Sebastien 2019
+ *      Philippe G. 2019, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ Drift correction by asynchronous resampling: the ratio stays within DRIFT_MAX_PPM of 1
+ and is slewed by a PI controller fed with the measured playback error, so that clock
+ drift is absorbed without skipping or pausing. It is independent from where the error
+ comes from and can serve any source that knows when frames are due (AirPlay, sync groups)
+*/
+
+#include "squeezelite.h"
+
+extern log_level loglevel;
+
+#define DRIFT_ONE		(1LL << 32)
+#define DRIFT_MAX_PPM	500
+#define DRIFT_KP		50		// ppm per ms of error
+#define DRIFT_KI		5		// ppm per ms of error, per update
+
+#if BYTES_PER_FRAME == 4
+#define DRIFT_MAX		0x7fffLL
+#else
+#define DRIFT_MAX		0x7fffffffLL
+#endif
+
+struct drift {
+	u64_t mu;				// Q32 position between hist[1] and hist[2]
+	u64_t step;				// Q32 input frames per output frame
+	ISAMPLE_T hist[4][2];
+	s32_t integral, ppm;
+};
+
+struct drift *drift_create(void) {
+	struct drift *d = calloc(1, sizeof(struct drift));
+
+	if (d) drift_reset(d);
+	else LOG_ERROR("can't create drift resampler");
+
+	return d;
+}
+
+void drift_delete(struct drift *d) {
+	free(d);
+}
+
+void drift_reset(struct drift *d) {
+	memset(d->hist, 0, sizeof(d->hist));
+	d->mu = 0;
+	d->step = DRIFT_ONE;
+	d->integral = d->ppm = 0;
+}
+
+// error is in ms, positive when frames play earlier than they should
+void drift_error(struct drift *d, s32_t error) {
+	s32_t max = DRIFT_MAX_PPM / DRIFT_KI;
+
+	d->integral += error;
+	if (d->integral > max) d->integral = max;
+	else if (d->integral < -max) d->integral = -max;
+
+	d->ppm = -(DRIFT_KP * error + DRIFT_KI * d->integral);
+	if (d->ppm > DRIFT_MAX_PPM) d->ppm = DRIFT_MAX_PPM;
+	else if (d->ppm < -DRIFT_MAX_PPM) d->ppm = -DRIFT_MAX_PPM;
+
+	d->step = DRIFT_ONE + DRIFT_ONE / 1000000 * d->ppm;
+
+	LOG_DEBUG("drift error %d ms, ratio %d ppm", error, d->ppm);
+}
+
+s32_t drift_ppm(struct drift *d) {
+	return d->ppm;
+}
+
+/*
+ Produce up to out_frames from in_frames using 4 points Hermite interpolation. Input is only
+ consumed when needed, so the caller loops until all is consumed. Returns frames produced
+*/
+#define DRIFT_RESAMPLE(NAME, ITYPE, CONV)														\
+frames_t NAME(struct drift *d, ITYPE *iptr, frames_t in_frames, ISAMPLE_T *optr, frames_t out_frames, frames_t *consumed) {	\
+	frames_t produced = 0;																		\
+	*consumed = 0;																				\
+	while (produced < out_frames) {																\
+		s64_t t;																				\
+		int ch;																					\
+		while (d->mu >= DRIFT_ONE) {															\
+			if (*consumed == in_frames) return produced;										\
+			memmove(d->hist[0], d->hist[1], sizeof(d->hist[0]) * 3);							\
+			d->hist[3][0] = CONV(*iptr++);														\
+			d->hist[3][1] = CONV(*iptr++);														\
+			d->mu -= DRIFT_ONE;																	\
+			(*consumed)++;																		\
+		}																						\
+		t = d->mu >> 16;																		\
+		for (ch = 0; ch < 2; ch++) {															\
+			s64_t y0 = d->hist[0][ch], y1 = d->hist[1][ch], y2 = d->hist[2][ch], y3 = d->hist[3][ch];	\
+			s64_t c1 = (y2 - y0) / 2;															\
+			s64_t c2 = y0 - (5 * y1) / 2 + 2 * y2 - y3 / 2;										\
+			s64_t c3 = (y3 - y0) / 2 + (3 * (y1 - y2)) / 2;										\
+			s64_t y = ((((((c3 * t) >> 16) + c2) * t >> 16) + c1) * t >> 16) + y1;				\
+			if (y > DRIFT_MAX) y = DRIFT_MAX;													\
+			else if (y < -DRIFT_MAX - 1) y = -DRIFT_MAX - 1;									\
+			*optr++ = y;																		\
+		}																						\
+		d->mu += d->step;																		\
+		produced++;																				\
+	}																							\
+	return produced;																			\
+}
+
+#define DRIFT_NATIVE(x)	(x)
+#define DRIFT_16(x)		((ISAMPLE_T) (x) * 65536)
+
+DRIFT_RESAMPLE(drift_resample, ISAMPLE_T, DRIFT_NATIVE)
+#if BYTES_PER_FRAME == 8
+DRIFT_RESAMPLE(drift_resample16, s16_t, DRIFT_16)
+#endif
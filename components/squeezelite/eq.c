@@ -0,0 +1,273 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Sebastien 2019
+ *      Philippe G. 2019, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// parametric equalizer processing stage - cascade of fixed-point biquads (Direct Form I)
+
+#include "squeezelite.h"
+
+#if PROCESS
+
+#include <math.h>
+#include <ctype.h>
+
+#if EMBEDDED
+#include "nvs.h"
+#include "esp_timer.h"
+extern char current_namespace[];
+#endif
+
+extern log_level loglevel;
+
+/*
+ a curve is a list of bands <type><freq>/<gain>[/<q>] separated by ';' where type is
+ p (peak), l (low shelf) or h (high shelf), freq in Hz and gain in dB, e.g.
+ "l80/4;p1200/-3/2;h8000/-2". It is given inline or as @<key> of an NVS string
+*/
+#define EQ_MAX_BANDS	10
+#define EQ_MAX_GAIN		15
+#define EQ_NVS_KEY		"eq_curve"
+#define EQ_COEF_BITS	28		// coefficients are Q3.28
+
+// samples are filtered on 16 bits or 24 bits so that 64 bits accumulators cannot overflow
+#if BYTES_PER_FRAME == 4
+#define EQ_SHIFT	0
+#define EQ_MAX		0x7fff
+#else
+#define EQ_SHIFT	8
+#define EQ_MAX		0x7fffff
+#endif
+
+struct eq_band {
+	char type;
+	float freq, gain, q;
+	s32_t b0, b1, b2, a1, a2;
+	s32_t x1[2], x2[2], y1[2], y2[2];
+	s32_t err[2];
+};
+
+static struct {
+	struct eq_band band[EQ_MAX_BANDS];
+	struct eq_band *active[EQ_MAX_BANDS];
+	int count, nactive;
+#if EMBEDDED
+	u64_t us;
+	unsigned long frames;
+#endif
+} eq;
+
+// error feedback keeps the truncated bits, so low frequency bands do not add noise
+static inline s32_t _biquad(struct eq_band *b, int ch, s32_t x) {
+	s64_t acc = (s64_t) b->b0 * x + (s64_t) b->b1 * b->x1[ch] + (s64_t) b->b2 * b->x2[ch]
+			  - (s64_t) b->a1 * b->y1[ch] - (s64_t) b->a2 * b->y2[ch] + b->err[ch];
+	s32_t y = acc >> EQ_COEF_BITS;
+
+	b->err[ch] = acc & ((1 << EQ_COEF_BITS) - 1);
+	if (y > EQ_MAX) y = EQ_MAX;
+	else if (y < -EQ_MAX - 1) y = -EQ_MAX - 1;
+
+	b->x2[ch] = b->x1[ch]; b->x1[ch] = x;
+	b->y2[ch] = b->y1[ch]; b->y1[ch] = y;
+
+	return y;
+}
+
+static bool _coef(double c, s32_t *coef) {
+	if (fabs(c) >= (1 << (31 - EQ_COEF_BITS))) return false;
+	*coef = lrint(c * (1 << EQ_COEF_BITS));
+	return true;
+}
+
+// RBJ audio EQ cookbook
+static bool _compute(struct eq_band *b, unsigned rate) {
+	double A = pow(10, b->gain / 40), w0 = 2 * M_PI * b->freq / rate;
+	double cs = cos(w0), alpha = sin(w0) / (2 * b->q), sq = 2 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (b->type) {
+	case 'p':
+		b0 = 1 + alpha * A; b1 = -2 * cs; b2 = 1 - alpha * A;
+		a0 = 1 + alpha / A; a1 = -2 * cs; a2 = 1 - alpha / A;
+		break;
+	case 'l':
+		b0 = A * ((A + 1) - (A - 1) * cs + sq); b1 = 2 * A * ((A - 1) - (A + 1) * cs); b2 = A * ((A + 1) - (A - 1) * cs - sq);
+		a0 = (A + 1) + (A - 1) * cs + sq; a1 = -2 * ((A - 1) + (A + 1) * cs); a2 = (A + 1) + (A - 1) * cs - sq;
+		break;
+	case 'h':
+		b0 = A * ((A + 1) + (A - 1) * cs + sq); b1 = -2 * A * ((A - 1) + (A + 1) * cs); b2 = A * ((A + 1) + (A - 1) * cs - sq);
+		a0 = (A + 1) - (A - 1) * cs + sq; a1 = 2 * ((A - 1) - (A + 1) * cs); a2 = (A + 1) - (A - 1) * cs - sq;
+		break;
+	default:
+		return false;
+	}
+
+	return _coef(b0 / a0, &b->b0) && _coef(b1 / a0, &b->b1) && _coef(b2 / a0, &b->b2) &&
+		   _coef(a1 / a0, &b->a1) && _coef(a2 / a0, &b->a2);
+}
+
+static void _reset(void) {
+	int i;
+
+	for (i = 0; i < eq.count; i++) {
+		struct eq_band *b = eq.band + i;
+		memset(b->x1, 0, sizeof(b->x1)); memset(b->x2, 0, sizeof(b->x2));
+		memset(b->y1, 0, sizeof(b->y1)); memset(b->y2, 0, sizeof(b->y2));
+		memset(b->err, 0, sizeof(b->err));
+	}
+}
+
+void eq_samples(struct processstate *process) {
+	ISAMPLE_T *iptr = (ISAMPLE_T *) process->inbuf, *optr = (ISAMPLE_T *) process->outbuf;
+	frames_t cnt = process->in_frames;
+#if EMBEDDED
+	s64_t start = esp_timer_get_time();
+#endif
+
+	while (cnt--) {
+		int ch, i;
+		for (ch = 0; ch < 2; ch++) {
+			s32_t x = *iptr++ >> EQ_SHIFT;
+			for (i = 0; i < eq.nactive; i++) x = _biquad(eq.active[i], ch, x);
+			*optr++ = (ISAMPLE_T) (x * (1 << EQ_SHIFT));
+		}
+	}
+
+	process->out_frames = process->in_frames;
+
+#if EMBEDDED
+	eq.us += esp_timer_get_time() - start;
+	eq.frames += process->in_frames;
+#endif
+}
+
+bool eq_drain(struct processstate *process) {
+	process->out_frames = 0;
+
+#if EMBEDDED
+	if (eq.frames) {
+		LOG_INFO("eq track complete - %d bands, %u cycles per frame per band", eq.nactive,
+				 (unsigned) (eq.us * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ / eq.frames / eq.nactive));
+	}
+#else
+	LOG_INFO("eq track complete");
+#endif
+
+	return true;
+}
+
+bool eq_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
+	int i;
+
+	eq.nactive = 0;
+
+	// unity bands and bands above nyquist are skipped, stage is bypassed if none is left
+	for (i = 0; i < eq.count; i++) {
+		struct eq_band *b = eq.band + i;
+		if (!b->gain || b->freq >= raw_sample_rate / 2) continue;
+		if (_compute(b, raw_sample_rate)) eq.active[eq.nactive++] = b;
+		else LOG_WARN("eq band %c%.0f/%.1f/%.2f out of range at %u", b->type, b->freq, b->gain, b->q, raw_sample_rate);
+	}
+
+	_reset();
+
+#if EMBEDDED
+	eq.us = 0;
+	eq.frames = 0;
+#endif
+
+	process->in_sample_rate = process->out_sample_rate = raw_sample_rate;
+
+	LOG_INFO("eq with %d active bands at %u", eq.nactive, raw_sample_rate);
+
+	return eq.nactive != 0;
+}
+
+void eq_flush(void) {
+	_reset();
+}
+
+static void _parse(char *curve) {
+	char *band = curve;
+
+	while (band && *band && eq.count < EQ_MAX_BANDS) {
+		struct eq_band *b = eq.band + eq.count;
+		char *next = strchr(band, ';');
+		int n;
+
+		if (next) *next++ = '\0';
+
+		b->type = tolower(*band);
+		b->q = 0.707;
+		n = sscanf(band + 1, "%f/%f/%f", &b->freq, &b->gain, &b->q);
+
+		if (n < 2 || !strchr("plh", b->type) || b->freq <= 0 || b->q <= 0) {
+			LOG_WARN("invalid eq band %s", band);
+		} else {
+			if (b->gain > EQ_MAX_GAIN) b->gain = EQ_MAX_GAIN;
+			else if (b->gain < -EQ_MAX_GAIN) b->gain = -EQ_MAX_GAIN;
+			LOG_INFO("eq band %c %.0fHz %.1fdB q:%.2f", b->type, b->freq, b->gain, b->q);
+			eq.count++;
+		}
+
+		band = next;
+	}
+}
+
+#if EMBEDDED
+static char *_load_curve(const char *key) {
+	nvs_handle nvs;
+	char *curve = NULL;
+	size_t len;
+
+	if (nvs_open(current_namespace, NVS_READONLY, &nvs) == ESP_OK) {
+		if (nvs_get_str(nvs, key, NULL, &len) == ESP_OK && (curve = malloc(len)) != NULL) {
+			nvs_get_str(nvs, key, curve, &len);
+		}
+		nvs_close(nvs);
+	}
+
+	if (!curve) LOG_WARN("no eq curve in nvs %s", key);
+
+	return curve;
+}
+#endif
+
+bool eq_init(char *opt) {
+	char *curve = NULL;
+
+	memset(&eq, 0, sizeof(eq));
+
+#if EMBEDDED
+	if (!*opt) curve = _load_curve(EQ_NVS_KEY);
+	else if (*opt == '@') curve = _load_curve(opt + 1);
+	else curve = strdup(opt);
+#else
+	curve = strdup(opt);
+#endif
+
+	if (curve) {
+		_parse(curve);
+		free(curve);
+	}
+
+	return eq.count != 0;
+}
+
+#endif // #if PROCESS
@@ -0,0 +1,498 @@
+/*
+ *  Squeezelite for esp32
+ *
+ *  (c) Sebastien 2019
+ *      Philippe G. 2019, philippe_44@outlook.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// FIR convolution processing stage - uniformly partitioned overlap-save in frequency domain
+
+#include "squeezelite.h"
+
+#if PROCESS
+
+#include <math.h>
+#include <sys/time.h>
+
+#if EMBEDDED
+#include "nvs.h"
+extern char current_namespace[];
+#endif
+
+extern log_level loglevel;
+
+/*
+ Taps are split in P partitions of B taps, each is transformed once with an FFT of N = 2B.
+ Every B frames, the last N input frames are transformed, stored in a spectrum delay line
+ and the sum of the P last spectra times their partition is transformed back. Left and
+ right are the real and imaginary parts of the same complex signal, so both channels run
+ through a single FFT (taps are the same for both). Latency is B frames.
+
+ At end of track, silence pushes the last B frames out. As these only depend on what came
+ before, they are also the first B frames the next track would produce, so when it has the
+ same rate, the state before drain is restored and these frames are not sent twice. The
+ delay line is only reset on flush or rate change, so gapless tracks stay gapless.
+
+ Float or fixed-point (Q31, scaled forward FFT) is chosen by defining FIR_FIXED at build
+*/
+#ifndef FIR_FIXED
+#define FIR_FIXED		0
+#endif
+
+#define FIR_BLOCK		256
+#define FIR_MAX_TAPS	16384
+
+#if FIR_FIXED
+typedef s32_t fir_t;
+#else
+typedef float fir_t;
+#endif
+
+struct cpx {
+	fir_t re, im;
+};
+
+static struct {
+	float *taps;
+	int ntaps;
+	unsigned rate;
+	int B, N, log2N, P;
+	struct cpx *H, *fdl, *in, *work, *tw;
+	u16_t *rev;
+	ISAMPLE_T *out;
+	int cur, pos;
+	frames_t drain, skip;
+	// state before drain, drain's FFT only overwrites the delay line slot that is next anyway
+	struct {
+		bool valid;
+		unsigned rate;
+		struct cpx *in;
+		ISAMPLE_T *out;
+		int cur, pos;
+	} resume;
+	unsigned stream_rate;
+#if FIR_FIXED
+	int gshift, hshift;
+#endif
+	u64_t us;
+	unsigned long frames;
+} fir;
+
+static u64_t _now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (u64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// radix-2 in-place FFT, forward is scaled by 1/N in fixed-point, inverse is never scaled
+static void _fft(struct cpx *x, bool inverse) {
+	int len, i, j;
+
+	for (i = 0; i < fir.N; i++) {
+		if (i < fir.rev[i]) {
+			struct cpx t = x[i];
+			x[i] = x[fir.rev[i]];
+			x[fir.rev[i]] = t;
+		}
+	}
+
+	for (len = 2; len <= fir.N; len <<= 1) {
+		int half = len / 2, step = fir.N / len;
+		for (i = 0; i < fir.N; i += len) {
+			for (j = 0; j < half; j++) {
+				struct cpx *a = x + i + j, *b = a + half, w = fir.tw[j * step], t;
+				if (inverse) w.im = -w.im;
+#if FIR_FIXED
+				t.re = ((s64_t) b->re * w.re - (s64_t) b->im * w.im) >> 31;
+				t.im = ((s64_t) b->re * w.im + (s64_t) b->im * w.re) >> 31;
+				if (inverse) {
+					b->re = a->re - t.re; b->im = a->im - t.im;
+					a->re += t.re; a->im += t.im;
+				} else {
+					b->re = ((s64_t) a->re - t.re) >> 1; b->im = ((s64_t) a->im - t.im) >> 1;
+					a->re = ((s64_t) a->re + t.re) >> 1; a->im = ((s64_t) a->im + t.im) >> 1;
+				}
+#else
+				t.re = b->re * w.re - b->im * w.im;
+				t.im = b->re * w.im + b->im * w.re;
+				b->re = a->re - t.re; b->im = a->im - t.im;
+				a->re += t.re; a->im += t.im;
+#endif
+			}
+		}
+	}
+}
+
+// one block of B frames is complete in the input window
+static void _convolve(void) {
+	struct cpx *X = fir.fdl + fir.cur * fir.N;
+	int p, k;
+
+	memcpy(X, fir.in, fir.N * sizeof(struct cpx));
+	_fft(X, false);
+	memmove(fir.in, fir.in + fir.B, fir.B * sizeof(struct cpx));
+
+	for (k = 0; k < fir.N; k++) {
+#if FIR_FIXED
+		s64_t re = 0, im = 0;
+#else
+		fir_t re = 0, im = 0;
+#endif
+		for (p = 0; p < fir.P; p++) {
+			struct cpx *x = fir.fdl + ((fir.cur - p + fir.P) % fir.P) * fir.N + k, *h = fir.H + p * fir.N + k;
+#if FIR_FIXED
+			re += ((s64_t) x->re * h->re - (s64_t) x->im * h->im) >> fir.hshift;
+			im += ((s64_t) x->re * h->im + (s64_t) x->im * h->re) >> fir.hshift;
+#else
+			re += x->re * h->re - x->im * h->im;
+			im += x->re * h->im + x->im * h->re;
+#endif
+		}
+		fir.work[k].re = re;
+		fir.work[k].im = im;
+	}
+
+	_fft(fir.work, true);
+
+	// overlap-save: only the last B points are valid
+	for (k = 0; k < fir.B; k++) {
+		struct cpx *y = fir.work + fir.B + k;
+#if FIR_FIXED
+#if BYTES_PER_FRAME == 4
+		s32_t l = y->re >> fir.gshift, r = y->im >> fir.gshift;
+		fir.out[2*k] = l > 0x7fff ? 0x7fff : l < -0x8000 ? -0x8000 : l;
+		fir.out[2*k+1] = r > 0x7fff ? 0x7fff : r < -0x8000 ? -0x8000 : r;
+#else
+		s64_t l = (s64_t) y->re << fir.gshift, r = (s64_t) y->im << fir.gshift;
+		fir.out[2*k] = l > 0x7fffffff ? 0x7fffffff : l < -0x7fffffff ? -0x7fffffff : l;
+		fir.out[2*k+1] = r > 0x7fffffff ? 0x7fffffff : r < -0x7fffffff ? -0x7fffffff : r;
+#endif
+#else
+#if BYTES_PER_FRAME == 4
+		fir.out[2*k] = lrintf(y->re > 32767.0f ? 32767.0f : y->re < -32768.0f ? -32768.0f : y->re);
+		fir.out[2*k+1] = lrintf(y->im > 32767.0f ? 32767.0f : y->im < -32768.0f ? -32768.0f : y->im);
+#else
+		fir.out[2*k] = lrintf(y->re > 2147483520.0f ? 2147483520.0f : y->re < -2147483520.0f ? -2147483520.0f : y->re);
+		fir.out[2*k+1] = lrintf(y->im > 2147483520.0f ? 2147483520.0f : y->im < -2147483520.0f ? -2147483520.0f : y->im);
+#endif
+#endif
+	}
+
+	fir.cur = (fir.cur + 1) % fir.P;
+}
+
+// output lags input by B frames, iptr NULL feeds silence, returns frames output
+static frames_t _run(ISAMPLE_T *iptr, ISAMPLE_T *optr, frames_t cnt) {
+	u64_t start = _now_us();
+	frames_t out = 0;
+
+	fir.frames += cnt;
+
+	while (cnt) {
+		frames_t f = min(cnt, fir.B - fir.pos), s = min(f, fir.skip);
+		struct cpx *x = fir.in + fir.B + fir.pos;
+		int i;
+
+		for (i = 0; i < f; i++, x++) {
+			if (!iptr) {
+				x->re = x->im = 0;
+				continue;
+			}
+#if FIR_FIXED && BYTES_PER_FRAME == 4
+			x->re = (s32_t) *iptr++ << fir.gshift;
+			x->im = (s32_t) *iptr++ << fir.gshift;
+#elif FIR_FIXED
+			x->re = *iptr++ >> fir.gshift;
+			x->im = *iptr++ >> fir.gshift;
+#else
+			x->re = *iptr++;
+			x->im = *iptr++;
+#endif
+		}
+
+		// frames already sent by previous track's drain are skipped
+		memcpy(optr, fir.out + (fir.pos + s) * 2, (f - s) * BYTES_PER_FRAME);
+		optr += (f - s) * 2;
+		out += f - s;
+		fir.skip -= s;
+		fir.pos += f;
+		cnt -= f;
+
+		if (fir.pos == fir.B) {
+			_convolve();
+			fir.pos = 0;
+		}
+	}
+
+	fir.us += _now_us() - start;
+
+	return out;
+}
+
+void fir_samples(struct processstate *process) {
+	process->out_frames = _run((ISAMPLE_T *) process->inbuf, (ISAMPLE_T *) process->outbuf, process->in_frames);
+}
+
+// push the last B frames out, the filter's tail is not played
+bool fir_drain(struct processstate *process) {
+	frames_t f = min(fir.drain, process->max_out_frames);
+
+	// a single FFT happens within the B frames of drain
+	if (fir.drain == fir.B) {
+		memcpy(fir.resume.in, fir.in, fir.N * sizeof(struct cpx));
+		memcpy(fir.resume.out, fir.out, fir.B * BYTES_PER_FRAME);
+		fir.resume.cur = fir.cur;
+		fir.resume.pos = fir.pos;
+	}
+
+	process->out_frames = _run(NULL, (ISAMPLE_T *) process->outbuf, f);
+	fir.drain -= f;
+
+	if (fir.drain) return false;
+
+	fir.resume.valid = true;
+	fir.resume.rate = fir.stream_rate;
+
+	if (fir.frames) {
+		LOG_INFO("fir track complete - %d taps at %u, %.1fx realtime", fir.ntaps, process->in_sample_rate,
+				 fir.us ? (double) fir.frames * 1000000 / process->in_sample_rate / fir.us : 0);
+	}
+
+	return true;
+}
+
+bool fir_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]) {
+
+	process->in_sample_rate = process->out_sample_rate = raw_sample_rate;
+
+	if (fir.rate && fir.rate != raw_sample_rate) {
+		LOG_INFO("fir designed for %u, bypassed at %u", fir.rate, raw_sample_rate);
+		fir.resume.valid = false;
+		return false;
+	}
+
+	// a single unity tap is a no-op
+	if (fir.ntaps == 1 && fir.taps[0] == 1.0f) return false;
+
+	// continue previous track (what its drain sent is skipped) or start from silence
+	if (fir.resume.valid && fir.resume.rate == raw_sample_rate) {
+		memcpy(fir.in, fir.resume.in, fir.N * sizeof(struct cpx));
+		memcpy(fir.out, fir.resume.out, fir.B * BYTES_PER_FRAME);
+		fir.cur = fir.resume.cur;
+		fir.pos = fir.resume.pos;
+		fir.drain = fir.skip = fir.B;
+		fir.resume.valid = false;
+	} else {
+		fir_flush();
+	}
+
+	fir.stream_rate = raw_sample_rate;
+	fir.us = fir.frames = 0;
+
+	LOG_INFO("fir with %d taps (%d x %d) at %u", fir.ntaps, fir.P, fir.B, raw_sample_rate);
+
+	return true;
+}
+
+void fir_flush(void) {
+	memset(fir.fdl, 0, fir.P * fir.N * sizeof(struct cpx));
+	memset(fir.in, 0, fir.N * sizeof(struct cpx));
+	memset(fir.out, 0, fir.B * BYTES_PER_FRAME);
+	fir.cur = fir.pos = 0;
+	fir.drain = fir.B;
+	fir.skip = 0;
+	fir.resume.valid = false;
+}
+
+static int _load_file(const char *name) {
+	FILE *f = fopen(name, "r");
+	char line[64];
+
+	if (!f) {
+		LOG_WARN("can't open fir file %s", name);
+		return 0;
+	}
+
+	fir.taps = malloc(FIR_MAX_TAPS * sizeof(float));
+
+	// one tap per line, # for comments
+	while (fir.taps && fir.ntaps < FIR_MAX_TAPS && fgets(line, sizeof(line), f)) {
+		if (*line != '#' && sscanf(line, "%f", fir.taps + fir.ntaps) == 1) fir.ntaps++;
+	}
+
+	fclose(f);
+	return fir.ntaps;
+}
+
+#if EMBEDDED
+// blob of little-endian floats
+static int _load_nvs(const char *key) {
+	nvs_handle nvs;
+	size_t len;
+
+	if (nvs_open(current_namespace, NVS_READONLY, &nvs) == ESP_OK) {
+		if (nvs_get_blob(nvs, key, NULL, &len) == ESP_OK && len <= FIR_MAX_TAPS * sizeof(float) &&
+			(fir.taps = malloc(len)) != NULL && nvs_get_blob(nvs, key, fir.taps, &len) == ESP_OK) {
+			fir.ntaps = len / sizeof(float);
+		}
+		nvs_close(nvs);
+	}
+
+	if (!fir.ntaps) LOG_WARN("no fir taps in nvs %s", key);
+
+	return fir.ntaps;
+}
+#endif
+
+// transform each partition of taps once for all
+static bool _prepare(void) {
+	struct cpx *H;
+	float *ftw, sum = 0;
+	int i, p, k, t;
+#if FIR_FIXED
+	float *h, max = 0;
+	int g;
+#endif
+
+	for (fir.log2N = 1; (1 << fir.log2N) < 2 * fir.B; fir.log2N++);
+	fir.N = 1 << fir.log2N;
+	fir.B = fir.N / 2;
+	fir.P = (fir.ntaps + fir.B - 1) / fir.B;
+
+	fir.H = malloc(fir.P * fir.N * sizeof(struct cpx));
+	fir.fdl = malloc(fir.P * fir.N * sizeof(struct cpx));
+	fir.in = malloc(fir.N * sizeof(struct cpx));
+	fir.work = malloc(fir.N * sizeof(struct cpx));
+	fir.tw = malloc(fir.N / 2 * sizeof(struct cpx));
+	fir.rev = malloc(fir.N * sizeof(u16_t));
+	fir.out = malloc(fir.B * BYTES_PER_FRAME);
+	fir.resume.in = malloc(fir.N * sizeof(struct cpx));
+	fir.resume.out = malloc(fir.B * BYTES_PER_FRAME);
+	ftw = malloc(fir.N * 2 * sizeof(float));
+#if FIR_FIXED
+	h = malloc(fir.P * fir.N * 2 * sizeof(float));
+#endif
+
+	if (!fir.H || !fir.fdl || !fir.in || !fir.work || !fir.tw || !fir.rev || !fir.out || !fir.resume.in || !fir.resume.out || !ftw
+#if FIR_FIXED
+		|| !h
+#endif
+		) {
+		LOG_ERROR("malloc fail creating fir buffers");
+		return false;
+	}
+
+	for (i = 0; i < fir.N; i++) {
+		ftw[2*i] = cos(2 * M_PI * i / fir.N);
+		ftw[2*i+1] = -sin(2 * M_PI * i / fir.N);
+		for (k = 0, fir.rev[i] = 0; k < fir.log2N; k++) if (i & (1 << k)) fir.rev[i] |= 1 << (fir.log2N - 1 - k);
+	}
+
+	for (i = 0; i < fir.N / 2; i++) {
+#if FIR_FIXED
+		fir.tw[i].re = lrint(ftw[2*i] * 2147483647.0);
+		fir.tw[i].im = lrint(ftw[2*i+1] * 2147483647.0);
+#else
+		fir.tw[i].re = ftw[2*i];
+		fir.tw[i].im = ftw[2*i+1];
+#endif
+	}
+
+	// plain DFT of each zero-padded partition, done only once
+	for (p = 0, H = fir.H; p < fir.P; p++, H += fir.N) {
+		for (k = 0; k < fir.N; k++) {
+			float re = 0, im = 0;
+			for (t = 0; t < fir.B && p * fir.B + t < fir.ntaps; t++) {
+				float v = fir.taps[p * fir.B + t];
+				int n = (k * t) % fir.N;
+				re += v * ftw[2*n];
+				im += v * ftw[2*n+1];
+			}
+#if FIR_FIXED
+			h[2*(p * fir.N + k)] = re;
+			h[2*(p * fir.N + k) + 1] = im;
+			max = fmaxf(max, fmaxf(fabsf(re), fabsf(im)));
+#else
+			// fold inverse FFT 1/N scaling in the taps
+			H[k].re = re / fir.N;
+			H[k].im = im / fir.N;
+#endif
+		}
+	}
+
+	for (i = 0; i < fir.ntaps; i++) sum += fabsf(fir.taps[i]);
+
+#if FIR_FIXED
+	// input is lowered by the taps' worst case gain so nothing can overflow, spectra use 30 bits
+	if (sum > (1 << 14)) {
+		LOG_ERROR("fir taps worst case gain %.0f is too high for fixed point (max %d)", sum, 1 << 14);
+		free(h);
+		free(ftw);
+		return false;
+	}
+	for (g = 0; (1 << g) < sum; g++);
+	for (fir.hshift = 30; fir.hshift > 0 && max * (1 << fir.hshift) >= (1 << 30); fir.hshift--);
+#if BYTES_PER_FRAME == 4
+	fir.gshift = 14 - g;
+#else
+	fir.gshift = 1 + g;
+#endif
+	for (i = 0; i < fir.P * fir.N; i++) {
+		fir.H[i].re = lrintf(h[2*i] * (1 << fir.hshift));
+		fir.H[i].im = lrintf(h[2*i+1] * (1 << fir.hshift));
+	}
+	free(h);
+#endif
+
+	free(ftw);
+
+	LOG_INFO("fir %d taps in %d partitions of %d, worst case gain %.2f", fir.ntaps, fir.P, fir.B, sum);
+
+	return true;
+}
+
+bool fir_init(char *opt) {
+	char *source, *rate, *block;
+
+	memset(&fir, 0, sizeof(fir));
+
+	// <file>|@<nvs key>[:<rate>[:<block>]]
+	source = next_param(opt, ':');
+	rate = next_param(NULL, ':');
+	block = next_param(NULL, ':');
+
+	if (!source) {
+		LOG_WARN("no fir taps source");
+		return false;
+	}
+
+	if (rate) fir.rate = atoi(rate);
+	fir.B = block ? atoi(block) : FIR_BLOCK;
+	if (fir.B < 16) fir.B = 16;
+
+#if EMBEDDED
+	if (*source == '@') _load_nvs(source + 1);
+	else
+#endif
+	_load_file(source);
+
+	if (!fir.ntaps) return false;
+
+	return _prepare();
+}
+
+#endif // #if PROCESS
@@ -102,7 +102,7 @@ static FLAC__StreamDecoderReadStatus read_cb(const FLAC__StreamDecoder *decoder,
 	LOCK_S;
 	bytes = min(_buf_used(streambuf), _buf_cont_read(streambuf));
 	bytes = min(bytes, *want);
-	end = (stream.state <= DISCONNECT && bytes == 0);
+	end = (_stream_ended() && bytes == 0);
 
 	memcpy(buffer, streambuf->readp, bytes);
 	_buf_inc_readp(streambuf, bytes);
@@ -177,25 +177,13 @@ static FLAC__StreamDecoderWriteStatus write_cb(const FLAC__StreamDecoder *decode
 		count = f;
 				
 		if (bits_per_sample == 8) {
-			while (count--) {
-				*optr++ = ALIGN8(*lptr++);
-				*optr++ = ALIGN8(*rptr++);
-			}
+			UNROLL4(count, *optr++ = ALIGN8(*lptr++); *optr++ = ALIGN8(*rptr++));
 		} else if (bits_per_sample == 16) {
-			while (count--) {
-				*optr++ = ALIGN16(*lptr++);
-				*optr++ = ALIGN16(*rptr++);
-			}
+			UNROLL4(count, *optr++ = ALIGN16(*lptr++); *optr++ = ALIGN16(*rptr++));
 		} else if (bits_per_sample == 24) {
-			while (count--) {
-				*optr++ = ALIGN24(*lptr++);
-				*optr++ = ALIGN24(*rptr++);
-			}
+			UNROLL4(count, *optr++ = ALIGN24(*lptr++); *optr++ = ALIGN24(*rptr++));
 		} else if (bits_per_sample == 32) {
-			while (count--) {
-				*optr++ = ALIGN32(*lptr++);
-				*optr++ = ALIGN32(*rptr++);
-			}
+			UNROLL4(count, *optr++ = ALIGN32(*lptr++); *optr++ = ALIGN32(*rptr++));
 		} else {
 			LOG_ERROR("unsupported bits per sample: %u", bits_per_sample);
 		}
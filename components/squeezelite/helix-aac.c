@@ -334,7 +334,7 @@ static decode_state helixaac_decode(void) {
 	bytes_total = _buf_used(streambuf);
 	bytes_wrap  = min(bytes_total, _buf_cont_read(streambuf));
 	
-	if (stream.state <= DISCONNECT && !bytes_total) {
+	if (_stream_ended() && !bytes_total) {
 		UNLOCK_S;
 		return DECODE_COMPLETE;
 	}
@@ -417,20 +417,9 @@ static decode_state helixaac_decode(void) {
 		}
 	}
 
-	if (bytes_wrap < WRAPBUF_LEN && bytes_total > WRAPBUF_LEN) {
-
-		// make a local copy of frames which may have wrapped round the end of streambuf
-		static u8_t buf[WRAPBUF_LEN];
-		memcpy(buf, streambuf->readp, bytes_wrap);
-		memcpy(buf + bytes_wrap, streambuf->buf, WRAPBUF_LEN - bytes_wrap);
-		
-		sptr = buf;
-		bytes = bytes_wrap = WRAPBUF_LEN;
-	} else {
-
-		sptr = streambuf->readp;
-		bytes = bytes_wrap;
-	}
+	// frames wrapping round end of streambuf are contiguous thanks to its mirrored tail
+	sptr = streambuf->readp;
+	bytes = bytes_wrap;
 	
 	// decode function changes iptr, so can't use streambuf->readp (same for bytes)
 	res = HAAC(a, Decode, a->hAac, &sptr, &bytes, (short*) a->write_buf);
@@ -91,10 +91,8 @@ extern struct processstate process;
 static inline ISAMPLE_T scale(mad_fixed_t sample) {
 	sample += (1L << (MAD_F_FRACBITS - 24));
 	
-	if (sample >= MAD_F_ONE)
-		sample = MAD_F_ONE - 1;
-	else if (sample < -MAD_F_ONE)
-		sample = -MAD_F_ONE;
+	// saturate using min/max, no branches on targets that have them
+	sample = min(max(sample, -MAD_F_ONE), MAD_F_ONE - 1);
 #if BYTES_PER_FRAME == 4	
 	return (ISAMPLE_T)((sample >> (MAD_F_FRACBITS + 1 - 24)) >> 8);
 #else	
@@ -202,7 +200,7 @@ static decode_state mad_decode(void) {
 	m->readbuf_len += bytes;
 	_buf_inc_readp(streambuf, bytes);
 
-	if (stream.state <= DISCONNECT && _buf_used(streambuf) == 0) {
+	if (_stream_ended() && _buf_used(streambuf) == 0) {
 		eos = true;
 		LOG_DEBUG("end of stream");
 		memset(m->readbuf + m->readbuf_len, 0, MAD_BUFFER_GUARD);
@@ -316,6 +314,7 @@ static decode_state mad_decode(void) {
 
 			count = f;
 
+			// not unrolled, compiler does better with the plain loop (see test/kernel_bench)
 			while (count--) {
 				*optr++ = scale(*iptrl++);
 				*optr++ = scale(*iptrr++);
@@ -70,6 +70,7 @@ static void usage(const char *argv0) {
 #endif
 		   "  -a <f>\t\tSpecify sample format (16|24|32) of output file when using -o - to output samples to stdout (interleaved little endian only)\n"
 		   "  -b <stream>:<output>\tSpecify internal Stream and Output buffer sizes in Kbytes\n"
+		   "  -B\t\t\tBuffer next track in a second Stream buffer while current one is decoded\n"
 		   "  -c <codec1>,<codec2>\tRestrict codecs to those specified, otherwise load all available codecs; known codecs: " CODECS "\n"
 		   "  \t\t\tCodecs reported to LMS in order listed, allowing codec priority refinement.\n"
 		   "  -C <timeout>\t\tClose output device when idle after timeout seconds, default is to keep it open while player is 'on'\n"
@@ -83,6 +84,7 @@ static void usage(const char *argv0) {
 #endif
 		   "  -e <codec1>,<codec2>\tExplicitly exclude native support of one or more codecs; known codecs: " CODECS "\n"
 		   "  -f <logfile>\t\tWrite debug to logfile\n"
+		   "  -k <retries>\t\tResume HTTP streams using Range requests after a remote disconnect, up to <retries> attempts\n"
 #if IR
 		   "  -i [<filename>]\tEnable lirc remote control support (lirc config file ~/.lircrc used if filename not specified)\n"
 #endif
@@ -96,6 +98,9 @@ static void usage(const char *argv0) {
 #endif
 #if LINUX || FREEBSD || SUN
 		   "  -P <filename>\t\tStore the process id (PID) in filename\n"
+#endif
+#if EMBEDDED
+		   "  -q <dither>\t\tDither when reducing to 16 bits, dither = t (TPDF) | s (TPDF with noise shaping)\n"
 #endif
 		   "  -r <rates>[:<delay>]\tSample rates supported, allows output to be off when squeezelite is started; rates = <maxrate>|<minrate>-<maxrate>|<rate1>,<rate2>,<rate3>; delay = optional delay switching rates in ms\n"
 #if GPIO
@@ -115,6 +120,12 @@ static void usage(const char *argv0) {
 		   "  -R -u [params]\tResample, params = (b|l|m)[:i],\n" 
 		   "   \t\t\t b = basic linear interpolation, l = 13 taps, m = 21 taps, i = interpolate filter coefficients\n"
 #endif
+#if PROCESS
+		   "  -E <stages>\t\tProcessing chain, stages = <stage>[:<params>],<stage>[:<params>]... applied in order, stage = resample|eq|fir\n"
+		   "  \t\t\t eq params = <curve> | @<nvs key> | none for nvs key eq_curve, curve = <band>;<band>... band = (p|l|h)<freq>/<gain dB>[/<q>]\n"
+		   "  \t\t\t fir params = <taps file>|@<nvs key>[:<rate>[:<block>]], file has one tap per line, only used at <rate> if set\n"
+		   "  \t\t\t -R [params] adds a resample stage first\n"
+#endif
 #if DSD
 #if ALSA
 		   "  -D [delay][:format]\tOutput device supports DSD, delay = optional delay switching between PCM and DSD in ms\n"
@@ -286,10 +297,18 @@ int main(int argc, char **argv) {
 	char *logfile = NULL;
 	u8_t mac[6];
 	unsigned stream_buf_size = STREAMBUF_SIZE;
+	unsigned resume_retries = 0;
+	bool prefetch = false;
+#if EMBEDDED
+	dither_mode dither = DITHER_OFF;
+#endif
 	unsigned output_buf_size = 0; // set later
 	unsigned rates[MAX_SUPPORTED_SAMPLERATES] = { 0 };
 	unsigned rate_delay = 0;
 	char *resample = NULL;
+#if PROCESS
+	char *dsp = NULL;
+#endif
 	char *output_params = NULL;
 	unsigned idle = 0;
 #if LINUX || FREEBSD || SUN
@@ -341,21 +360,27 @@ int main(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("oabcCdefmMnNpPrs"
+		if (strstr("oabcCdefkmMnNpPrs"
 #if ALSA
 				   "UVO"
 #endif
+#if EMBEDDED
+				   "q"
+#endif
 /* 
  * only allow '-Z <rate>' override of maxSampleRate 
  * reported by client if built with the capability to resample!
  */
 #if RESAMPLE || RESAMPLE16
 				   "Z"
+#endif
+#if PROCESS
+				   "E"
 #endif
 				   , opt) && optind < argc - 1) {
 			optarg = argv[optind + 1];
 			optind += 2;
-		} else if (strstr("ltz?W"
+		} else if (strstr("ltz?WB"
 #if ALSA
 						  "LX"
 #endif
@@ -416,6 +441,19 @@ int main(int argc, char **argv) {
 		case 'e':
 			exclude_codecs = optarg;
 			break;
+		case 'k':
+			resume_retries = atoi(optarg);
+			break;
+		case 'B':
+			prefetch = true;
+			break;
+#if EMBEDDED
+		case 'q':
+			if (*optarg == 's') dither = DITHER_SHAPED;
+			else if (*optarg == 't') dither = DITHER_TPDF;
+			else dither = DITHER_OFF;
+			break;
+#endif
 		case 'd':
 			{
 				char *l = strtok(optarg, "=");
@@ -554,6 +592,11 @@ int main(int argc, char **argv) {
 			maxSampleRate = atoi(optarg);
 			break;
 #endif
+#if PROCESS
+		case 'E':
+			dsp = optarg;
+			break;
+#endif
 #if DSD
 		case 'D':
 			dsd_outfmt = DOP;
@@ -758,10 +801,10 @@ int main(int argc, char **argv) {
 	winsock_init();
 #endif
 
-	stream_init(log_stream, stream_buf_size);
+	stream_init(log_stream, stream_buf_size, resume_retries, prefetch);
 
 #if EMBEDDED
-	output_init_embedded(log_output, output_device, output_buf_size, output_params, rates, rate_delay, idle);
+	output_init_embedded(log_output, output_device, output_buf_size, output_params, rates, rate_delay, idle, dither);
 #else
 	if (!strcmp(output_device, "-")) {
 		output_init_stdout(log_output, output_buf_size, output_params, rates, rate_delay);
@@ -788,9 +831,9 @@ int main(int argc, char **argv) {
 
 	decode_init(log_decode, include_codecs, exclude_codecs);
 
-#if RESAMPLE || RESAMPLE16
-	if (resample) {
-		process_init(resample);
+#if PROCESS
+	if (resample || dsp) {
+		process_init(resample, dsp);
 	}
 #endif
 
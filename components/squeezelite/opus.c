@@ -116,7 +116,7 @@ static decode_state opus_decompress(void) {
 
 	LOCK_S;
 
-	if (stream.state <= DISCONNECT && !_buf_used(streambuf)) {
+	if (_stream_ended() && !_buf_used(streambuf)) {
 		UNLOCK_S;
 		return DECODE_COMPLETE;
 	}
@@ -219,7 +219,7 @@ static decode_state opus_decompress(void) {
 
 	} else if (n == 0) {
 
-		if (stream.state <= DISCONNECT) {
+		if (_stream_ended()) {
 			LOG_INFO("partial decode");
 			UNLOCK_O_direct;
 			UNLOCK_S;
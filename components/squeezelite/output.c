@@ -275,6 +275,8 @@ frames_t _output_frames(frames_t avail) {
 			
 	LOG_SDEBUG("wrote %u frames", frames);
 
+	if (frames && !silence) decode_wake_space(_buf_space(outputbuf));
+
 	return frames;
 }
 
@@ -350,7 +352,7 @@ void output_init_common(log_level level, const char *device, unsigned output_buf
 	output.init_size = output_buf_size;
 	LOG_DEBUG("outputbuf size: %u", output_buf_size);
 
-	buf_init(outputbuf, output_buf_size);
+	buf_init(outputbuf, output_buf_size, 0);
 	if (!outputbuf->buf) {
 		LOG_ERROR("unable to malloc output buffer");
 		exit(0);
@@ -30,8 +30,6 @@ extern u8_t *silencebuf;
 
 #define LOCK   mutex_lock(outputbuf->mutex)
 #define UNLOCK mutex_unlock(outputbuf->mutex)
-#define LOCK_S   mutex_lock(streambuf->mutex)
-#define UNLOCK_S mutex_unlock(streambuf->mutex)
 
 #define FRAME_BLOCK MAX_SILENCE_FRAMES
 
@@ -92,29 +90,11 @@ static int _write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t g
 	assert(btout != NULL);
 	
 	if (!silence ) {
-				
-		if (output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS && *cross_ptr) {
-			_apply_cross(outputbuf, out_frames, cross_gain_in, cross_gain_out, cross_ptr);
-		}
-
-		if (gainL != FIXED_ONE || gainR!= FIXED_ONE) {
-			_apply_gain(outputbuf, out_frames, gainL, gainR);
-		}
-
-#if BYTES_PER_FRAME == 4
-		memcpy(btout + oframes * BYTES_PER_FRAME, outputbuf->readp, out_frames * BYTES_PER_FRAME);
-#else
-	{
-		frames_t count = out_frames;
-		s32_t *_iptr = (s32_t*) outputbuf->readp;
-		s16_t *_optr = (s16_t*) (btout + oframes * BYTES_PER_FRAME);
-		while (count--) {
-			*_optr++ = *_iptr++ >> 16;
-			*_optr++ = *_iptr++ >> 16;
-		}
-	}
-#endif
-
+		bool cross = output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS && *cross_ptr;
+		
+		// cross-fade, gain and pack to 16 bits straight into btout
+		_cross_scale_and_pack_frames(btout + oframes * BYTES_PER_FRAME, outputbuf, out_frames, gainL, gainR, 
+									 cross_gain_in, cross_gain_out, cross ? cross_ptr : NULL, S16_LE);
 	} else {
 
 		u8_t *buf = silencebuf;
@@ -167,9 +147,8 @@ void output_bt_tick(void) {
 	
 	if (!running) return;
 		
-	LOCK_S;
+	// occupancy can be read lock-free, no need to contend with stream thread
     SET_MIN_MAX_SIZED(_buf_used(streambuf), stream_buf, streambuf->size);
-    UNLOCK_S;
 	
 	if (lastTime <= gettime_ms() )
 	{
@@ -47,7 +47,7 @@ static bool (*volume_cb)(unsigned left, unsigned right);
 static void (*close_cb)(void);
 
 void output_init_embedded(log_level level, char *device, unsigned output_buf_size, char *params, 
-						  unsigned rates[], unsigned rate_delay, unsigned idle) {
+						  unsigned rates[], unsigned rate_delay, unsigned idle, dither_mode dither) {
 	loglevel = level;						
 	LOG_INFO("init device: %s", device);
 	
@@ -55,6 +55,7 @@ void output_init_embedded(log_level level, char *device, unsigned output_buf_siz
 	output_init_common(level, device, output_buf_size, rates, idle);
 	output.start_frames = FRAME_BLOCK;
 	output.rate_delay = rate_delay;
+	output.dither = dither;
 	
 	if (strcasestr(device, "BT ")) {
 		LOG_INFO("init Bluetooth");
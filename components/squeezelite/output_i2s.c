@@ -21,23 +21,22 @@
  
 /* 
 Synchronisation is a bit of a hack with i2s. The esp32 driver is always
-full when it starts, so there is a delay of the total length of buffers.
-In other words, i2w_write blocks at first call, until at least one buffer
-has been written (it uses a queue with produce / consume).
-
-The first hack is to consume that length at the beginning of tracks when
-synchronization is active. It's about ~180ms @ 44.1kHz
-
-The second hack is that we never know exactly the number of frames in the 
-DMA buffers when we update the output.frames_played_dmp. We assume that
-after i2s_write, these buffers are always full so by measuring the gap
-between time after i2s_write and update of frames_played_dmp, we have a
-good idea of the error. 
-
-The third hack is when sample rate changes, buffers are reset and we also
-do the change too early, but can't do that exaclty at the right time. So 
-there might be a pop and a de-sync when sampling rate change happens. Not
-sure that using rate_delay would fix that
+full once started, so there is a delay of the total length of buffers. The
+DMA is only (re)started once primed with what it can take, and its geometry
+is set per rate so that this length is always ~DMA_LATENCY_MS.
+
+The first hack is to consume what is queued at the beginning of tracks when
+synchronization is active. 
+
+The number of frames in the DMA buffers when we update frames_played_dmp
+is given by the (patched) driver, which tracks the position of the DMA in
+the descriptors ring from its interrupt handler. It is exact at buffer 
+level and interpolated inside the buffer being sent.
+
+When sample rate changes at a track start, the DMA is first drained of the
+frames at the previous rate, then the clock is switched and the DMA is only
+restarted once it has been primed with frames at the new rate. Nothing is 
+discarded and frames_played / device_frames stay accurate across the change
 */
 
 #include "squeezelite.h"
@@ -45,6 +44,7 @@ sure that using rate_delay would fix that
 #include "driver/i2s.h"
 #include "driver/i2c.h"
 #include "driver/gpio.h"
+#include "esp_attr.h"
 #include "perf_trace.h"
 #include <signal.h>
 #include "time.h"
@@ -54,6 +54,8 @@ sure that using rate_delay would fix that
 #define UNLOCK mutex_unlock(outputbuf->mutex)
 
 #define FRAME_BLOCK MAX_SILENCE_FRAMES
+// SPDIF is encoded by chunks (16 bytes per frame)
+#define SPDIF_BLOCK	256
 
 // Prevent compile errors if dac output is
 // included in the build and not actually activated in menuconfig
@@ -82,18 +84,26 @@ sure that using rate_delay would fix that
 #ifndef CONFIG_SPDIF_NUM
 #define CONFIG_SPDIF_NUM -1
 #endif
+#ifndef CONFIG_I2S_DMA_MAX_RATE
+#define CONFIG_I2S_DMA_MAX_RATE 48000
+#endif
 
 typedef enum { DAC_ON = 0, DAC_OFF, DAC_POWERDOWN, DAC_VOLUME } dac_cmd_e;
 
-// must have an integer ratio with FRAME_BLOCK (see spdif comment)
-#define DMA_BUF_LEN		512	
-#define DMA_BUF_COUNT	12
+// DMA geometry is set per rate to hold DMA_LATENCY_MS, in buffers of DMA_BUF_MS, up 
+// to CONFIG_I2S_DMA_MAX_RATE, higher rates get less latency. The pool never exceeds 
+// DMA_POOL_FRAMES, which is what fixed 12 x 512 buffers used to take
+#define DMA_LATENCY_MS	80
+#define DMA_BUF_MS		8
+#define DMA_BUF_MAX		4092
+#define DMA_POOL_FRAMES	(12*512)
 
 #define DECLARE_ALL_MIN_MAX 	\
 	DECLARE_MIN_MAX(o); 		\
 	DECLARE_MIN_MAX(s); 		\
 	DECLARE_MIN_MAX(rec); 		\
 	DECLARE_MIN_MAX(i2s_time); 	\
+	DECLARE_MIN_MAX(lock_time); \
 	DECLARE_MIN_MAX(buffering);
 
 #define RESET_ALL_MIN_MAX 		\
@@ -101,6 +111,7 @@ typedef enum { DAC_ON = 0, DAC_OFF, DAC_POWERDOWN, DAC_VOLUME } dac_cmd_e;
 	RESET_MIN_MAX(s); 			\
 	RESET_MIN_MAX(rec);	\
 	RESET_MIN_MAX(i2s_time);	\
+	RESET_MIN_MAX(lock_time);	\
 	RESET_MIN_MAX(buffering);
 	
 #define STATS_PERIOD_MS 5000
@@ -109,6 +120,11 @@ extern struct outputstate output;
 extern struct buffer *streambuf;
 extern struct buffer *outputbuf;
 extern u8_t *silencebuf;
+extern int i2s_get_dma_queued(i2s_port_t i2s_num);
+extern esp_err_t i2s_drain_tx(i2s_port_t i2s_num, TickType_t ticks_to_wait);
+extern esp_err_t i2s_reset_tx(i2s_port_t i2s_num);
+extern esp_err_t i2s_alloc_tx_pool(i2s_port_t i2s_num, size_t size, int max_count);
+extern esp_err_t i2s_set_tx_geometry(i2s_port_t i2s_num, int dma_buf_count, int dma_buf_len);
 
 static log_level loglevel;
 static bool running, isI2SStarted;
@@ -118,13 +134,17 @@ static thread_type thread, stats_thread;
 static u8_t *obuf;
 static frames_t oframes;
 static bool spdif;
-static size_t dma_buf_frames;
+static int dma_frame_bytes;
+static size_t dma_pool_size;
+static frames_t prime_frames;
 
 DECLARE_ALL_MIN_MAX;
 
 static int _i2s_write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t gainR,
 								s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr);
 static void *output_thread_i2s();
+static void dma_geometry(u32_t rate, int *count, int *len);
+static void set_dma_geometry(u32_t rate);
 static void *output_thread_i2s_stats();
 static void dac_cmd(dac_cmd_e cmd, ...);
 static void spdif_convert(ISAMPLE_T *src, size_t frames, u32_t *dst, size_t *count);
@@ -252,7 +272,12 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	bytes_per_frame = 2*2;
 #endif
 
-	if (strcasestr(device, "spdif")) spdif = true;
+	if (strcasestr(device, "spdif")) {
+		spdif = true;
+		// SPDIF encodes ISAMPLE_T, so 24 bits are sent when available
+		output.format = BYTES_PER_FRAME == 8 ? S32_LE : S16_LE;
+		bytes_per_frame = BYTES_PER_FRAME;
+	}	
 
 	output.write_cb = &_i2s_write_frames;
 	obuf = malloc(FRAME_BLOCK * bytes_per_frame);
@@ -261,8 +286,6 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 		return;
 	}
 		
-	running=true;
-
 	i2s_pin_config_t pin_config;
 	
 	if (spdif) {
@@ -271,25 +294,19 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 									};
 		i2s_config.sample_rate = output.current_sample_rate * 2;
 		i2s_config.bits_per_sample = 32;
-		// Normally counted in frames, but 16 sample are transformed into 32 bits in spdif
-		i2s_config.dma_buf_len = DMA_BUF_LEN / 2;	
-		i2s_config.dma_buf_count = DMA_BUF_COUNT * 2;
 		/* 
-		   In DMA, we have room for (LEN * COUNT) frames of 32 bits samples that 
-		   we push at sample_rate * 2. Each of these peuso-frames is a single true
-		   audio frame. So the real depth is true frames is (LEN * COUNT / 2)
+		   DMA frames are 32 bits samples that we push at sample_rate * 2, so each 
+		   pair of these pseudo-frames is a single true audio frame.
 		*/   
-		dma_buf_frames = DMA_BUF_COUNT * DMA_BUF_LEN / 2;	
+		dma_frame_bytes = 2 * 4;
 	} else {
 		pin_config = (i2s_pin_config_t) { .bck_io_num = CONFIG_I2S_BCK_IO, .ws_io_num = CONFIG_I2S_WS_IO, 
 										.data_out_num = CONFIG_I2S_DO_IO, .data_in_num = -1 //Not used
 									};
 		i2s_config.sample_rate = output.current_sample_rate;
 		i2s_config.bits_per_sample = bytes_per_frame * 8 / 2;
-		// Counted in frames (but i2s allocates a buffer <= 4092 bytes)
-		i2s_config.dma_buf_len = DMA_BUF_LEN;	
-		i2s_config.dma_buf_count = DMA_BUF_COUNT;
-		dma_buf_frames = DMA_BUF_COUNT * DMA_BUF_LEN;	
+		// driver rounds samples to 16 bits multiple
+		dma_frame_bytes = 2 * ((i2s_config.bits_per_sample + 15) / 16) * 2;
 #ifdef TAS575x	
 		gpio_pad_select_gpio(CONFIG_SPDIF_DO_IO);
 		gpio_set_direction(CONFIG_SPDIF_DO_IO, GPIO_MODE_OUTPUT);
@@ -304,19 +321,42 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
 	i2s_config.tx_desc_auto_clear = true;		
 	i2s_config.use_apll = true;
 	i2s_config.intr_alloc_flags = ESP_INTR_FLAG_LEVEL1; //Interrupt level 1
+	// minimal buffers, real ones are taken from the pool, per rate
+	i2s_config.dma_buf_len = 8;	
+	i2s_config.dma_buf_count = 2;
 
-	LOG_INFO("Initializing I2S mode %s with rate: %d, bits per sample: %d, buffer frames: %d, number of buffers: %d ", 
-			spdif ? "S/PDIF" : "normal", 
-			i2s_config.sample_rate, i2s_config.bits_per_sample, i2s_config.dma_buf_len, i2s_config.dma_buf_count);
+	LOG_INFO("Initializing I2S mode %s with rate: %d, bits per sample: %d", 
+			spdif ? "S/PDIF" : "normal", i2s_config.sample_rate, i2s_config.bits_per_sample);
 
 	i2s_driver_install(CONFIG_I2S_NUM, &i2s_config, 0, NULL);
 	i2s_set_pin(CONFIG_I2S_NUM, &pin_config);
-	i2s_stop(CONFIG_I2S_NUM);
-	i2s_zero_dma_buffer(CONFIG_I2S_NUM);
+	
+	// allocate once what the most demanding rate needs, up to configured one (within a limit)
+	int pool_count = 0;
+	for (int i = 0; i < MAX_SUPPORTED_SAMPLERATES && output.supported_rates[i]; i++) {
+		int count, len;
+		dma_geometry(min(output.supported_rates[i], CONFIG_I2S_DMA_MAX_RATE), &count, &len);
+		pool_count = max(pool_count, count);
+		dma_pool_size = max(dma_pool_size, count * len * dma_frame_bytes);
+	}
+	dma_pool_size = min(dma_pool_size, DMA_POOL_FRAMES * dma_frame_bytes);
+	
+	if (i2s_alloc_tx_pool(CONFIG_I2S_NUM, dma_pool_size, pool_count) != ESP_OK) {
+		LOG_ERROR("Cannot allocate DMA pool of %zu bytes", dma_pool_size);
+		i2s_driver_uninstall(CONFIG_I2S_NUM);
+		free(obuf);
+		obuf = NULL;
+		return;
+	}
+	
+	// leaves DMA stopped 
+	set_dma_geometry(output.current_sample_rate);
 	isI2SStarted=false;
 	
 	dac_cmd(DAC_OFF);
 
+	running = true;
+
 	esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
 	
     cfg.thread_name= "output_i2s";
@@ -338,14 +378,18 @@ void output_init_i2s(log_level level, char *device, unsigned output_buf_size, ch
  * Terminate DAC output
  */
 void output_close_i2s(void) {
-	LOCK;
-	running = false;
-	UNLOCK;
-	pthread_join(thread, NULL);
-	pthread_join(stats_thread, NULL);
+	// nothing was started if init failed
+	if (obuf) {
+		LOCK;
+		running = false;
+		UNLOCK;
+		pthread_join(thread, NULL);
+		pthread_join(stats_thread, NULL);
 	
-	i2s_driver_uninstall(CONFIG_I2S_NUM);
-	free(obuf);
+		i2s_driver_uninstall(CONFIG_I2S_NUM);
+		free(obuf);
+		obuf = NULL;
+	}	
 	
 #ifdef TAS575x	
 	i2c_driver_delete(I2C_PORT);
@@ -369,47 +413,66 @@ bool output_volume_i2s(unsigned left, unsigned right) {
 static int _i2s_write_frames(frames_t out_frames, bool silence, s32_t gainL, s32_t gainR,
 								s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr) {
 #if BYTES_PER_FRAME == 8									
-	s32_t *optr;
+	s32_t *optr = (s32_t*) (silence ? silencebuf : outputbuf->readp);
+	
+	IF_DSD(
+	if (output.outfmt == DOP) {
+			update_dop((u32_t *) optr, out_frames, output.invert);
+		} else if (output.outfmt != PCM && output.invert)
+			dsd_invert((u32_t *) optr, out_frames);
+	)
 #endif	
 	
 	if (!silence) {
-		if (output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS && *cross_ptr) {
-			_apply_cross(outputbuf, out_frames, cross_gain_in, cross_gain_out, cross_ptr);
-		}
+		bool cross = output.fade == FADE_ACTIVE && output.fade_dir == FADE_CROSS && *cross_ptr;
 		
-#if BYTES_PER_FRAME == 4
-		if (gainL != FIXED_ONE || gainR!= FIXED_ONE) {
-			_apply_gain(outputbuf, out_frames, gainL, gainR);
-		}
-			
-		memcpy(obuf + oframes * bytes_per_frame, outputbuf->readp, out_frames * bytes_per_frame);
-#else
-		optr = (s32_t*) outputbuf->readp;	
-#endif		
+		// cross-fade, gain and pack straight into obuf
+		_cross_scale_and_pack_frames(obuf + oframes * bytes_per_frame, outputbuf, out_frames, gainL, gainR, 
+									 cross_gain_in, cross_gain_out, cross ? cross_ptr : NULL, output.format);
 	} else {
 #if BYTES_PER_FRAME == 4		
 		memcpy(obuf + oframes * bytes_per_frame, silencebuf, out_frames * bytes_per_frame);
 #else		
-		optr = (s32_t*) silencebuf;
+		_scale_and_pack_frames(obuf + oframes * bytes_per_frame, optr, out_frames, gainL, gainR, output.format);
 #endif	
 	}
 
-#if BYTES_PER_FRAME == 8
-	IF_DSD(
-	if (output.outfmt == DOP) {
-			update_dop((u32_t *) optr, out_frames, output.invert);
-		} else if (output.outfmt != PCM && output.invert)
-			dsd_invert((u32_t *) optr, out_frames);
-	)
-
-	_scale_and_pack_frames(obuf + oframes * bytes_per_frame, optr, out_frames, gainL, gainR, output.format);
-#endif	
-
 	oframes += out_frames;
 
 	return out_frames;
 }
 
+/****************************************************************************************
+ * DMA geometry for a rate: buffers of DMA_BUF_MS (within driver's limit) to hold DMA_LATENCY_MS
+ */
+static void dma_geometry(u32_t rate, int *count, int *len) {
+	// SPDIF is sent at twice the rate
+	u32_t dma_rate = spdif ? rate * 2 : rate;
+	
+	*len = min(dma_rate * DMA_BUF_MS / 1000, DMA_BUF_MAX / dma_frame_bytes);
+	*count = max((dma_rate * DMA_LATENCY_MS / 1000 + *len - 1) / *len, 3);
+}
+
+static void set_dma_geometry(u32_t rate) {
+	int count, len;
+
+	dma_geometry(rate, &count, &len);
+	if (count * len * dma_frame_bytes > dma_pool_size) {
+		count = max(dma_pool_size / (len * dma_frame_bytes), 3);
+		len = min(len, dma_pool_size / (count * dma_frame_bytes));
+		LOG_WARN("DMA pool of %zu bytes is too small for %u, latency is lower than %u ms", 
+				 dma_pool_size, rate, DMA_LATENCY_MS);
+	}	
+	
+	// what the DMA can take while stopped, one buffer is never available (SPDIF is 2 DMA frames per frame)
+	prime_frames = (count - 1) * len / (spdif ? 2 : 1);
+
+	LOG_INFO("DMA geometry for %u: %d buffers of %d frames (%u ms)", rate, count, len, 
+			 (count * len * 1000) / (spdif ? rate * 2 : rate));
+			 
+	i2s_set_tx_geometry(CONFIG_I2S_NUM, count, len);
+}
+
 /****************************************************************************************
  * Main output thread
  */
@@ -418,13 +481,13 @@ static void *output_thread_i2s() {
 	frames_t iframes = FRAME_BLOCK;
 	uint32_t timer_start = 0;
 	int discard = 0;
-	uint32_t fullness = gettime_ms();
-	bool synced;
+	bool synced, priming = false;
+	frames_t primed = 0;
 	output_state state = OUTPUT_OFF;
 	char *sbuf = NULL;
 	
 	// spdif needs 16 bytes per frame : 32 bits/sample, 2 channels, BMC encoded
-	if (spdif && (sbuf = malloc(FRAME_BLOCK * 16)) == NULL) {
+	if (spdif && (sbuf = malloc(SPDIF_BLOCK * 16)) == NULL) {
 		LOG_ERROR("Cannot allocate SPDIF buffer");
 	}
 	
@@ -433,6 +496,7 @@ static void *output_thread_i2s() {
 		TIME_MEASUREMENT_START(timer_start);
 		
 		LOCK;
+		SET_MIN_MAX(TIME_MEASUREMENT_GET(timer_start), lock_time);
 				
 		// manage led display
 		if (state != output.state) {
@@ -460,8 +524,8 @@ static void *output_thread_i2s() {
 		oframes = 0;
 		output.updated = gettime_ms();
 		output.frames_played_dmp = output.frames_played;
-		// try to estimate how much we have consumed from the DMA buffer (calculation is incorrect at the very beginning ...)
-		output.device_frames = dma_buf_frames - ((output.updated - fullness) * output.current_sample_rate) / 1000;
+		// what is still queued in the DMA buffers (samples are 16 bits aligned, SPDIF uses 2 DMA frames per frame)
+		output.device_frames = i2s_get_dma_queued(CONFIG_I2S_NUM) / (spdif ? 2 * dma_frame_bytes : dma_frame_bytes);
 		_output_frames( iframes );
 		// oframes must be a global updated by the write callback
 		output.frames_in_process = oframes;
@@ -492,41 +556,63 @@ static void *output_thread_i2s() {
 		if (!isI2SStarted ) {
 			isI2SStarted = true;
 			LOG_INFO("Restarting I2S.");
-			i2s_zero_dma_buffer(CONFIG_I2S_NUM);
-			i2s_start(CONFIG_I2S_NUM);
+			if (i2s_config.sample_rate != output.current_sample_rate) {
+				i2s_config.sample_rate = output.current_sample_rate;
+				i2s_set_sample_rates(CONFIG_I2S_NUM, spdif ? i2s_config.sample_rate * 2 : i2s_config.sample_rate);
+				set_dma_geometry(i2s_config.sample_rate);
+			} else {
+				i2s_reset_tx(CONFIG_I2S_NUM);
+			}	
+			priming = true;
+			primed = 0;
 			if (!spdif) dac_cmd(DAC_ON);	
 		} 
 		
-		// this does not work well as set_sample_rates resets the fifos (and it's too early)
-		if (i2s_config.sample_rate != output.current_sample_rate) {
-			LOG_INFO("changing sampling rate %u to %u", i2s_config.sample_rate, output.current_sample_rate);
-			/* 
-			if (synced)
-				//  can sleep for a buffer_queue - 1 and then eat a buffer (discard) if we are synced
-				usleep(((DMA_BUF_COUNT - 1) * DMA_BUF_LEN * bytes_per_frame * 1000) / 44100 * 1000);
-				discard = DMA_BUF_COUNT * DMA_BUF_LEN * bytes_per_frame;
-			}	
-			*/
-			i2s_config.sample_rate = output.current_sample_rate;
-			i2s_set_sample_rates(CONFIG_I2S_NUM, spdif ? i2s_config.sample_rate * 2 : i2s_config.sample_rate);
-			i2s_zero_dma_buffer(CONFIG_I2S_NUM);
-			//return;
+		// DMA is stopped while primed, start it before it can't take more
+		if (priming && primed + oframes > prime_frames) {
+			LOG_INFO("DMA primed with %u frames", primed);
+			priming = false;
+			i2s_start(CONFIG_I2S_NUM);
 		}
 		
 		// we assume that here we have been able to entirely fill the DMA buffers
 		if (spdif) {
-			spdif_convert((ISAMPLE_T*) obuf, oframes, (u32_t*) sbuf, &count);
-			i2s_write(CONFIG_I2S_NUM, sbuf, oframes * 16, &bytes, portMAX_DELAY);
-			bytes /= 4;
+			size_t chunk;
+			bytes = 0;
+			for (frames_t done = 0, n; done < oframes; done += n) {
+				n = min(oframes - done, SPDIF_BLOCK);
+				spdif_convert((ISAMPLE_T*) obuf + done * 2, n, (u32_t*) sbuf, &count);
+				i2s_write(CONFIG_I2S_NUM, sbuf, n * 16, &chunk, portMAX_DELAY);
+				bytes += chunk;
+			}	
+			bytes = bytes / 16 * bytes_per_frame;
 		} else {
 			i2s_write(CONFIG_I2S_NUM, obuf, oframes * bytes_per_frame, &bytes, portMAX_DELAY);			
 		}	
-		fullness = gettime_ms();
 			
 		if (bytes != oframes * bytes_per_frame) {
 			LOG_WARN("I2S DMA Overflow! available bytes: %d, I2S wrote %d bytes", oframes * bytes_per_frame, bytes);
 		}
 		
+		primed += oframes;
+		
+		/* 
+		A track start at a new rate has just been reached and these were the last 
+		frames at the previous rate: let them all play, then change clock and prime
+		DMA with the new rate before restarting it
+		*/
+		if (i2s_config.sample_rate != output.current_sample_rate) {
+			LOG_INFO("changing sampling rate %u to %u", i2s_config.sample_rate, output.current_sample_rate);
+			if (i2s_drain_tx(CONFIG_I2S_NUM, pdMS_TO_TICKS(100)) != ESP_OK) {
+				LOG_WARN("I2S DMA not drained");
+			}	
+			i2s_config.sample_rate = output.current_sample_rate;
+			i2s_set_sample_rates(CONFIG_I2S_NUM, spdif ? i2s_config.sample_rate * 2 : i2s_config.sample_rate);
+			set_dma_geometry(i2s_config.sample_rate);
+			priming = true;
+			primed = 0;
+		}
+		
 		SET_MIN_MAX( TIME_MEASUREMENT_GET(timer_start),i2s_time);
 		
 	}
@@ -562,6 +648,7 @@ static void *output_thread_i2s_stats() {
 			LOG_INFO("              ----------+----------+-----------+-----------+  ");
 			LOG_INFO("              max (us)  | min (us) |   avg(us) |  count    |  ");
 			LOG_INFO("              ----------+----------+-----------+-----------+  ");
+			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("Lock(us)",lock_time));
 			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("Buffering(us)",buffering));
 			LOG_INFO(LINE_MIN_MAX_DURATION_FORMAT,LINE_MIN_MAX_DURATION("i2s tfr(us)",i2s_time));
 			LOG_INFO("              ----------+----------+-----------+-----------+");
@@ -619,6 +706,7 @@ void dac_cmd(dac_cmd_e cmd, ...) {
 #define PREAMBLE_W  (0xE4) //11100100
 
 #define VUCP   		((0xCC) << 24)
+#define VUCP_P 		((0x32) << 24)	// parity set, starts at the opposite level
 #define VUCP_MUTE 	((0xD4) << 24)	// To mute PCM, set VUCP = invalid.
 
 extern const u16_t spdif_bmclookup[256];
@@ -631,44 +719,89 @@ extern const u16_t spdif_bmclookup[256];
  the 16 bits samples are aligned with a BMC word boundary. Note that the LSB of the
  audio is transmitted first (not the MSB) and that ESP32 libray sends R then L, 
  contrary to what seems to be usually done, so (dst) order had to be changed
+ 
+ Lookup entries all end at level 0 and start at level 1 for bytes of even parity, so 
+ each BMC word is inverted when the next one does not start at level 1, i.e. by the 
+ parity of all the bytes that follow it. With 16 bits samples, the first A bit is used 
+ as parity so that P and VUCP can be fixed. With 24 bits samples, AAAA are the 4 LSB 
+ of audio so P is computed (from the same start levels, no separate parity pass) and 
+ the VUCP word, sent ahead of next subframe, is selected with it. In both cases, 
+ parity is even so all subframes end at level 0 and preambles can be fixed as well.
+ The three words of a 24 bits subframe do not depend on each other. Frames are encoded 
+ as a W subframe then an M (or B every 192 frames) one, count is always even between 
+ frames.
 */
-void spdif_convert(ISAMPLE_T *src, size_t frames, u32_t *dst, size_t *count) {
+static inline u32_t spdif_subframe(ISAMPLE_T src, u32_t *dst, u32_t preamble, u32_t vucp) {
 	u16_t hi, lo, aux;
-	
-	// frames are 2 channels of 16 bits
-	frames *= 2;
-
-	while (frames--) {
 #if BYTES_PER_FRAME == 4		
-		hi  = spdif_bmclookup[(u8_t)(*src >> 8)];
-		lo  = spdif_bmclookup[(u8_t) *src];
+	hi  = spdif_bmclookup[(u8_t)(src >> 8)];
+	lo  = spdif_bmclookup[(u8_t) src];
+	lo ^= ~((s16_t)hi) >> 16;
+
+	// 16 bits sample:
+	*(dst+0) = ((u32_t)lo << 16) | hi;
+
+	// 4 bits auxillary-audio-databits, the first used as parity
+	aux = 0xb333 ^ (((u32_t)((s16_t)lo)) >> 17);
 #else
-		hi  = spdif_bmclookup[(u8_t)(*src >> 24)];
-		lo  = spdif_bmclookup[(u8_t) *src >> 16];
+	u32_t sample = (u32_t) src >> 8;
+	s32_t sh, sm, sl;
+	
+	hi  = spdif_bmclookup[(u8_t)(sample >> 16)];
+	lo  = spdif_bmclookup[(u8_t)(sample >> 8)];
+	aux = spdif_bmclookup[(u8_t) sample];
+	
+	// all ones when the byte has even parity (word starts at level 1)
+	sh = (s16_t) hi >> 15;
+	sm = (s16_t) lo >> 15;
+	sl = (s16_t) aux >> 15;
+	
+	// 16 MSB of sample, inverted when the 24 bits have odd parity
+	hi ^= ~(sh ^ sm ^ sl);
+	lo ^= sm ^ sl;
+	*(dst+0) = ((u32_t)lo << 16) | hi;
+	
+	// 8 LSB of sample in auxillary-audio-databits and audio LSB
+	aux ^= ~sl;
 #endif	
-		lo ^= ~((s16_t)hi) >> 16;
-
-		// 16 bits sample:
-		*(dst+0) = ((u32_t)lo << 16) | hi;
 
-		// 4 bits auxillary-audio-databits, the first used as parity
-		aux = 0xb333 ^ (((u32_t)((s16_t)lo)) >> 17);
+	// VUCP-Bits: Valid, Subcode, Channelstatus, Parity
+	*(dst+1) = vucp | (preamble << 16) | aux;
+	
+#if BYTES_PER_FRAME == 8
+	// VUCP to send with next subframe
+	return (sh ^ sm ^ sl) ? VUCP : VUCP_P;
+#else
+	return VUCP;
+#endif	
+}
 
-		// VUCP-Bits: Valid, Subcode, Channelstatus, Parity = 0
-		// As parity is always 0, we can use fixed preambles
-		if (++(*count) > 383) {
-			*(dst+1) =  VUCP | (PREAMBLE_B << 16 ) | aux; //special preamble for one of 192 frames
-			*count = 0;
+void spdif_convert(ISAMPLE_T *src, size_t frames, u32_t *dst, size_t *count) {
+	// VUCP of previous subframe, which is sent with this one's preamble
+	static u32_t vucp_last = VUCP;
+	u32_t vucp = vucp_last;
+	size_t cnt = *count;
+	
+	while (frames--) {
+		vucp = spdif_subframe(*src++, dst, PREAMBLE_W, vucp);
+		
+		// special preamble for one of 192 frames
+		cnt += 2;
+		if (cnt > 383) {
+			vucp = spdif_subframe(*src++, dst + 2, PREAMBLE_B, vucp);
+			cnt = 0;
 		} else {
-			*(dst+1) = VUCP | ((((*count) & 0x01) ? PREAMBLE_W : PREAMBLE_M) << 16) | aux;
-		}
+			vucp = spdif_subframe(*src++, dst + 2, PREAMBLE_M, vucp);
+		}	
 		
-		src++;
-		dst += 2;
+		dst += 4;
 	}
+	
+	*count = cnt;
+	vucp_last = vucp;
 }
 
-const u16_t spdif_bmclookup[256] = { //biphase mark encoded values (least significant bit first)
+const u16_t DRAM_ATTR spdif_bmclookup[256] = { //biphase mark encoded values (least significant bit first)
 	0xcccc, 0x4ccc, 0x2ccc, 0xaccc, 0x34cc, 0xb4cc, 0xd4cc, 0x54cc,
 	0x32cc, 0xb2cc, 0xd2cc, 0x52cc, 0xcacc, 0x4acc, 0x2acc, 0xaacc,
 	0x334c, 0xb34c, 0xd34c, 0x534c, 0xcb4c, 0x4b4c, 0x2b4c, 0xab4c,
@@ -23,6 +23,8 @@
 
 #include "squeezelite.h"
 
+extern struct outputstate output;
+
 #if BYTES_PER_FRAM == 4
 #define MAX_VAL16 0x7fffffffLL
 #define MAX_SCALESAMPLE 0x7fffffffffffLL
@@ -348,7 +350,7 @@ void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gai
 	ISAMPLE_T *ptr = (ISAMPLE_T *)(void *)outputbuf->readp;
 	frames_t count = out_frames * 2;
 	while (count--) {
-		if (*cross_ptr > (ISAMPLE_T *)outputbuf->wrap) {
+		if (*cross_ptr >= (ISAMPLE_T *)outputbuf->wrap) {
 			*cross_ptr -= outputbuf->size / BYTES_PER_FRAME * 2;
 		}
 		*ptr = gain(cross_gain_out, *ptr) + gain(cross_gain_in, **cross_ptr);
@@ -370,3 +372,176 @@ void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t ga
 	}
 }
 
+
+#if BYTES_PER_FRAME == 4
+// 16 bits samples can't overflow the product, so only saturate result instead of wrapping
+static inline s32_t sample_gain(s32_t gain, s32_t sample) {
+	s32_t res = ((s64_t)gain * (s64_t)sample) >> 16;
+	return min(max(res, -0x8000), 0x7fff);
+}
+#else
+#define sample_gain(g, s) gain(g, s)
+#endif
+
+static struct {
+	u32_t seed;
+	s32_t error[2];
+} dither_state = { 0x9e3779b9 };
+
+/* 
+ Narrow a value with 16 fractional bits to 16 bits with +/-1 LSB TPDF dither (difference 
+ of the two halves of a xorshift32) instead of truncating. With noise shaping, the error of 
+ previous sample is fed back (first order) which pushes noise towards high frequencies
+*/
+static inline s32_t narrow16(s64_t v, int ch) {
+	u32_t r = dither_state.seed;
+	s64_t q;
+	
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	dither_state.seed = r;
+	
+	v -= dither_state.error[ch];
+	q = (v + (s32_t) (r & 0xffff) - (s32_t) (r >> 16) + 0x8000) >> 16;
+	q = min(max(q, -0x8000), 0x7fff);
+	
+	// error is bounded so that clipping does not make it run away
+	if (output.dither == DITHER_SHAPED) dither_state.error[ch] = min(max((q << 16) - v, -0x20000), 0x20000);
+	
+	return q;
+}
+
+#define SAMPLE_GAIN(g, s, ch) sample_gain(g, s)
+#define DITHER_GAIN(g, s, ch) narrow16((s64_t) (g) * (s), ch)
+
+// fused cross-fade, gain and pack kernels: read outputbuf once and write device buffer directly
+// gains move by stepL/R every frame when ramping
+#define CROSS_SCALE_PACK(NAME, OTYPE, GAIN, PACK)										\
+static void NAME(void *outputptr, ISAMPLE_T *iptr, ISAMPLE_T *xptr, frames_t cnt,		\
+				 s32_t gainL, s32_t gainR, s32_t stepL, s32_t stepR,					\
+				 s32_t cross_gain_in, s32_t cross_gain_out) {							\
+	OTYPE *optr = (OTYPE *) outputptr;													\
+	if (xptr) {																			\
+		UNROLL4(cnt, {																	\
+			s32_t l = GAIN(gainL, (ISAMPLE_T) (gain(cross_gain_out, *iptr++) + gain(cross_gain_in, *xptr++)), 0);	\
+			s32_t r = GAIN(gainR, (ISAMPLE_T) (gain(cross_gain_out, *iptr++) + gain(cross_gain_in, *xptr++)), 1);	\
+			PACK;																		\
+			gainL += stepL; gainR += stepR;												\
+		});																				\
+	} else if (stepL || stepR) {														\
+		UNROLL4(cnt, {																	\
+			s32_t l = GAIN(gainL, *iptr++, 0);											\
+			s32_t r = GAIN(gainR, *iptr++, 1);											\
+			PACK;																		\
+			gainL += stepL; gainR += stepR;												\
+		});																				\
+	} else if (gainL != FIXED_ONE || gainR != FIXED_ONE) {								\
+		UNROLL4(cnt, {																	\
+			s32_t l = GAIN(gainL, *iptr++, 0);											\
+			s32_t r = GAIN(gainR, *iptr++, 1);											\
+			PACK;																		\
+		});																				\
+	} else {																			\
+		UNROLL4(cnt, {																	\
+			s32_t l = *iptr++;															\
+			s32_t r = *iptr++;															\
+			PACK;																		\
+		});																				\
+	}																					\
+}
+
+// with 16 bits samples, only gain narrows (unity gain is bit-perfect and not dithered)
+#if BYTES_PER_FRAME == 4
+CROSS_SCALE_PACK(_cross_scale_pack16, s16_t, SAMPLE_GAIN, *optr++ = l; *optr++ = r)
+CROSS_SCALE_PACK(_cross_scale_pack16_dither, s16_t, DITHER_GAIN, *optr++ = l; *optr++ = r)
+#elif SL_LITTLE_ENDIAN
+CROSS_SCALE_PACK(_cross_scale_pack_S16_LE, u32_t, SAMPLE_GAIN, *optr++ = (l >> 16 & 0x0000ffff) | (r & 0xffff0000))
+CROSS_SCALE_PACK(_cross_scale_pack_S16_LE_dither, u32_t, SAMPLE_GAIN, *optr++ = (narrow16(l, 0) & 0x0000ffff) | (u32_t) narrow16(r, 1) << 16)
+CROSS_SCALE_PACK(_cross_scale_pack_S24_LE, u32_t, SAMPLE_GAIN, *optr++ = l >> 8; *optr++ = r >> 8)
+CROSS_SCALE_PACK(_cross_scale_pack_S32_LE, u32_t, SAMPLE_GAIN, *optr++ = l; *optr++ = r)
+#endif
+
+// gain changes are ramped linearly over that duration, to avoid zipper noise
+#define GAIN_RAMP_MS	5
+
+static struct {
+	s32_t gainL, gainR;			// gains currently applied
+	s32_t targetL, targetR;
+	s32_t stepL, stepR;
+	frames_t frames;			// left to reach target
+} ramp;
+
+/* 
+ Cross-fade (when cross_ptr is set), gain and pack cnt frames from outputbuf's readp into 
+ outputptr. The cross pointer is handled per contiguous span instead of checking wrap for 
+ every sample. With 16 bits samples, format is ignored and output is always 16 bits. 
+ When gains change, they are ramped sample by sample from the ones in use, in the same 
+ pass. Formats without a fused kernel fall back to in-place cross-fade + _scale_and_pack_frames
+*/
+void _cross_scale_and_pack_frames(void *outputptr, struct buffer *outputbuf, frames_t cnt, s32_t gainL, s32_t gainR, 
+								  s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr, output_format format) {
+	ISAMPLE_T *iptr = (ISAMPLE_T *)(void *)outputbuf->readp;
+	u8_t *optr = (u8_t *)outputptr;
+	size_t obytes;
+	void (*kernel)(void *, ISAMPLE_T *, ISAMPLE_T *, frames_t, s32_t, s32_t, s32_t, s32_t, s32_t, s32_t);
+
+#if BYTES_PER_FRAME == 4
+	kernel = output.dither ? _cross_scale_pack16_dither : _cross_scale_pack16;
+	obytes = 4;
+#else
+	switch (format) {
+#if SL_LITTLE_ENDIAN		
+	case S16_LE: kernel = output.dither ? _cross_scale_pack_S16_LE_dither : _cross_scale_pack_S16_LE; obytes = 4; break;
+	case S24_LE: kernel = _cross_scale_pack_S24_LE; obytes = 8; break;
+	case S32_LE: kernel = _cross_scale_pack_S32_LE; obytes = 8; break;
+#endif	
+	default:
+		if (cross_ptr && *cross_ptr) _apply_cross(outputbuf, cnt, cross_gain_in, cross_gain_out, cross_ptr);
+		_scale_and_pack_frames(outputptr, iptr, cnt, gainL, gainR, format);
+		return;
+	}
+#endif
+
+	// new gain requested, ramp from where we are (ramp is 0 initially so we fade in)
+	if (gainL != ramp.targetL || gainR != ramp.targetR) {
+		ramp.frames = max(output.current_sample_rate * GAIN_RAMP_MS / 1000, 1);
+		ramp.targetL = gainL;
+		ramp.targetR = gainR;
+		ramp.stepL = (gainL - ramp.gainL) / (s32_t) ramp.frames;
+		ramp.stepR = (gainR - ramp.gainR) / (s32_t) ramp.frames;
+	}
+
+	while (cnt) {
+		ISAMPLE_T *xptr = NULL;
+		frames_t span = cnt;
+		s32_t stepL = 0, stepR = 0;
+
+		if (ramp.frames) {
+			span = min(span, ramp.frames);
+			stepL = ramp.stepL;
+			stepR = ramp.stepR;
+		}
+
+		if (cross_ptr && *cross_ptr) {
+			if (*cross_ptr >= (ISAMPLE_T *)(void *)outputbuf->wrap) {
+				*cross_ptr -= outputbuf->size / BYTES_PER_FRAME * 2;
+			}
+			span = min(span, ((ISAMPLE_T *)(void *)outputbuf->wrap - *cross_ptr) / 2);
+			xptr = *cross_ptr;
+			*cross_ptr += span * 2;
+		}
+
+		kernel(optr, iptr, xptr, span, ramp.gainL, ramp.gainR, stepL, stepR, cross_gain_in, cross_gain_out);
+
+		if (ramp.frames) {
+			ramp.frames -= span;
+			ramp.gainL = ramp.frames ? ramp.gainL + (s32_t) span * stepL : ramp.targetL;
+			ramp.gainR = ramp.frames ? ramp.gainR + (s32_t) span * stepR : ramp.targetR;
+		}
+
+		iptr += span * 2;
+		optr += span * obytes;
+		cnt -= span;
+	}
+}
@@ -185,7 +185,6 @@ static decode_state pcm_decode(void) {
 	frames_t frames, count;
 	OPTR_T *optr;
 	u8_t  *iptr;
-	u8_t tmp[3*8];
 	
 	LOCK_S;
 
@@ -204,7 +203,7 @@ static decode_state pcm_decode(void) {
 		out = process.max_in_frames;
 	);
 
-	if ((stream.state <= DISCONNECT && bytes == 0) || (limit && audio_left == 0)) {
+	if ((_stream_ended() && bytes == 0) || (limit && audio_left == 0)) {
 		UNLOCK_O_direct;
 		UNLOCK_S;
 		return DECODE_COMPLETE;
@@ -251,17 +250,9 @@ static decode_state pcm_decode(void) {
 	);
 	iptr = (u8_t *)streambuf->readp;
 
+	// frames wrapping round end of streambuf are contiguous thanks to its mirrored tail
 	in = bytes / bytes_per_frame;
 
-	//  handle frame wrapping round end of streambuf
-	//  - only need if resizing of streambuf does not avoid this, could occur in localfile case
-	if (in == 0 && bytes > 0 && _buf_used(streambuf) >= bytes_per_frame) {
-		memcpy(tmp, iptr, bytes);
-		memcpy(tmp + bytes, streambuf->buf, bytes_per_frame - bytes);
-		iptr = tmp;
-		in = 1;
-	}
-
 	frames = min(in, out);
 	frames = min(frames, MAX_DECODE_FRAMES);
 
@@ -274,70 +265,50 @@ static decode_state pcm_decode(void) {
 
 	if (channels == 2) {
 		if (sample_size == 1) {
-			while (count--) {
-				*optr++ = *iptr++ << (24-SHIFT);
-			}
+			UNROLL4(count, *optr++ = *iptr++ << (24-SHIFT));
 		} else if (sample_size == 2) {
 			if (bigendian) {
 #if BYTES_PER_FRAME == 4 && !SL_LITTLE_ENDIAN			
 				// while loop below works as is, but memcpy is a win for that 16/16 typical case
 				memcpy(optr, iptr, count * BYTES_PER_FRAME / 2);
 #else				
-				while (count--) {
-					*optr++ = *(iptr) << (24-SHIFT) | *(iptr+1) << (16-SHIFT);
-					iptr += 2;
-				}
+				UNROLL4(count, *optr++ = *(iptr) << (24-SHIFT) | *(iptr+1) << (16-SHIFT); iptr += 2);
 #endif				
 			} else {
 #if BYTES_PER_FRAME == 4 && SL_LITTLE_ENDIAN			
 				// while loop below works as is, but memcpy is a win for that 16/16 typical case
 				memcpy(optr, iptr, count * BYTES_PER_FRAME / 2);
 #else
-				while (count--) {
-					*optr++ = *(iptr) << (16-SHIFT) | *(iptr+1) << (24-SHIFT);
-					iptr += 2;
-				}
+				UNROLL4(count, *optr++ = *(iptr) << (16-SHIFT) | *(iptr+1) << (24-SHIFT); iptr += 2);
 #endif	
 			}
 		} else if (sample_size == 3) {
 			if (bigendian) {
-				while (count--) {
-#if BYTES_PER_FRAME == 4				
-					*optr++ = *(iptr) << 8 | *(iptr+1);
-#else					
-					*optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8;
-#endif	
-					iptr += 3;
-				}
+#if BYTES_PER_FRAME == 4
+				UNROLL4(count, *optr++ = *(iptr) << 8 | *(iptr+1); iptr += 3);
+#else
+				UNROLL4(count, *optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8; iptr += 3);
+#endif
 			} else {
-				while (count--) {
-#if BYTES_PER_FRAME == 4									
-					*optr++ = *(iptr+1) | *(iptr+2) << 8;
+#if BYTES_PER_FRAME == 4
+				UNROLL4(count, *optr++ = *(iptr+1) | *(iptr+2) << 8; iptr += 3);
 #else
-					*optr++ = *(iptr) << 8 | *(iptr+1) << 16 | *(iptr+2) << 24;
-#endif	
-					iptr += 3;
-				}
+				UNROLL4(count, *optr++ = *(iptr) << 8 | *(iptr+1) << 16 | *(iptr+2) << 24; iptr += 3);
+#endif
 			}
 		} else if (sample_size == 4) {
 			if (bigendian) {
-				while (count--) {
-#if BYTES_PER_FRAME == 4														
-					*optr++ = *(iptr) << 8 | *(iptr+1);
+#if BYTES_PER_FRAME == 4
+				UNROLL4(count, *optr++ = *(iptr) << 8 | *(iptr+1); iptr += 4);
 #else
-					*optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8 | *(iptr+3);
-#endif	
-					iptr += 4;
-				}
+				UNROLL4(count, *optr++ = *(iptr) << 24 | *(iptr+1) << 16 | *(iptr+2) << 8 | *(iptr+3); iptr += 4);
+#endif
 			} else {
-				while (count--) {
-#if BYTES_PER_FRAME == 4																			
-					*optr++ = *(iptr+2) | *(iptr+3) << 8;
+#if BYTES_PER_FRAME == 4
+				UNROLL4(count, *optr++ = *(iptr+2) | *(iptr+3) << 8; iptr += 4);
 #else
-					*optr++ = *(iptr) | *(iptr+1) << 8 | *(iptr+2) << 16 | *(iptr+3) << 24;
-#endif	
-					iptr += 4;
-				}
+				UNROLL4(count, *optr++ = *(iptr) | *(iptr+1) << 8 | *(iptr+2) << 16 | *(iptr+3) << 24; iptr += 4);
+#endif
 			}
 		}
 	} else if (channels == 1) {
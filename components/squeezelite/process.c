@@ -20,6 +20,7 @@
  */
 
 // sample processing - only included when building with PROCESS set
+// processing is a chain of stages, each reading process.inbuf and writing process.outbuf
 
 #include "squeezelite.h"
 
@@ -37,23 +38,40 @@ extern struct codec *codec;
 #define LOCK_O   mutex_lock(outputbuf->mutex)
 #define UNLOCK_O mutex_unlock(outputbuf->mutex)
 
-// macros to map to processing functions - currently only resample.c
-// this can be made more generic when multiple processing mechanisms get added
+// known processing stages, chain order is set on the command line
+static const struct process_stage stages[] = {
 #if RESAMPLE || RESAMPLE16
-#define SAMPLES_FUNC resample_samples
-#define DRAIN_FUNC   resample_drain
-#define NEWSTREAM_FUNC resample_newstream
-#define FLUSH_FUNC   resample_flush
-#define INIT_FUNC    resample_init
+	{ "resample", resample_init, resample_newstream, resample_samples, resample_drain, resample_flush },
 #endif
-
+	{ "eq", eq_init, eq_newstream, eq_samples, eq_drain, eq_flush },
+	{ "fir", fir_init, fir_newstream, fir_samples, fir_drain, fir_flush },
+	{ NULL }
+};
+
+#define MAX_STAGES	8
+
+static struct {
+	const struct process_stage *stage[MAX_STAGES];
+	bool active[MAX_STAGES];
+	int count;
+} chain;
+
+// stage consumed inbuf and produced outbuf, which becomes the next stage's inbuf
+static void _swap_buffers(void) {
+	u8_t *buf = process.inbuf;
+	process.inbuf = process.outbuf;
+	process.outbuf = buf;
+	process.in_frames = process.out_frames;
+	process.out_frames = 0;
+}
 
 // transfer all processed frames to the output buf
-static void _write_samples(void) {
-	frames_t frames = process.out_frames;
-	ISAMPLE_T *iptr   = (ISAMPLE_T *) process.outbuf;
+static void _write_samples(u8_t *buf, frames_t frames) {
+	ISAMPLE_T *iptr   = (ISAMPLE_T *) buf;
 	unsigned cnt  = 10;
 
+	process.total_out += frames;
+
 	LOCK_O;
 
 	while (frames > 0) {
@@ -91,35 +109,72 @@ static void _write_samples(void) {
 	UNLOCK_O;
 }
 
+// run in_frames through active stages from 'first' and write result - inactive stages are skipped, no copy
+static void _run_chain(int first) {
+	int i;
+
+	for (i = first; i < chain.count && process.in_frames; i++) {
+		if (!chain.active[i]) continue;
+		chain.stage[i]->samples(&process);
+		_swap_buffers();
+	}
+
+	_write_samples(process.inbuf, process.in_frames);
+}
+
 // process samples - called with decode mutex set
 void process_samples(void) {
 
-	SAMPLES_FUNC(&process);
+	process.total_in += process.in_frames;
 
-	_write_samples();
+	_run_chain(0);
 
 	process.in_frames = 0;
 }
 
 // drain at end of track - called with decode mutex set
 void process_drain(void) {
-	bool done;
+	int i;
 
-	do {
+	// each stage's tail goes through the stages after it
+	for (i = 0; i < chain.count; i++) {
+		bool done;
 
-		done = DRAIN_FUNC(&process);
+		if (!chain.active[i]) continue;
 
-		_write_samples();
+		do {
+			process.in_frames = 0;
+			done = chain.stage[i]->drain(&process);
+			_swap_buffers();
+			_run_chain(i + 1);
+		} while (!done);
+	}
 
-	} while (!done);
+	process.in_frames = 0;
 
 	LOG_DEBUG("processing track complete - frames in: %lu out: %lu", process.total_in, process.total_out);
 }	
 
 // new stream - called with decode mutex set
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]) {
+	unsigned rate = raw_sample_rate, max_rate = raw_sample_rate;
+	bool active = false;
+	int i;
+
+	// each stage sees the rate produced by the previous active one
+	for (i = 0; i < chain.count; i++) {
+		process.in_sample_rate = process.out_sample_rate = rate;
+		chain.active[i] = chain.stage[i]->newstream(&process, rate, supported_rates);
+		if (chain.active[i]) {
+			rate = process.out_sample_rate;
+			max_rate = max(max_rate, rate);
+			active = true;
+		}
+		LOG_INFO("processing %s: %s", chain.stage[i]->name, chain.active[i] ? "active" : "bypassed");
+	}
 
-	bool active = NEWSTREAM_FUNC(&process, raw_sample_rate, supported_rates);
+	process.in_sample_rate = raw_sample_rate;
+	process.out_sample_rate = rate;
 
 	LOG_INFO("processing: %s", active ? "active" : "inactive");
 
@@ -135,25 +190,23 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 		max_in_frames = codec->min_space / BYTES_PER_FRAME ;
 
 		// increase size of output buffer by 10% as output rate is not an exact multiple of input rate
-		if (process.out_sample_rate % process.in_sample_rate == 0) {
-			max_out_frames = max_in_frames * (process.out_sample_rate / process.in_sample_rate);
+		if (max_rate % raw_sample_rate == 0) {
+			max_out_frames = max_in_frames * (max_rate / raw_sample_rate);
 		} else {
-			max_out_frames = (int)(1.1 * (float)max_in_frames * (float)process.out_sample_rate / (float)process.in_sample_rate);
+			max_out_frames = (int)(1.1 * (float)max_in_frames * (float)max_rate / (float)raw_sample_rate);
 		}
 
-		if (process.max_in_frames != max_in_frames) {
-			LOG_DEBUG("creating process buf in frames: %u", max_in_frames);
-			if (process.inbuf) free(process.inbuf);
-			process.inbuf = malloc(max_in_frames * BYTES_PER_FRAME);
-			process.max_in_frames = max_in_frames;
-		}
-		
+		// buffers are swapped between stages so both must hold the largest intermediate result
 		if (process.max_out_frames != max_out_frames) {
-			LOG_DEBUG("creating process buf out frames: %u", max_out_frames);
+			LOG_DEBUG("creating process bufs frames: %u", max_out_frames);
+			if (process.inbuf) free(process.inbuf);
 			if (process.outbuf) free(process.outbuf);
+			process.inbuf = malloc(max_out_frames * BYTES_PER_FRAME);
 			process.outbuf = malloc(max_out_frames * BYTES_PER_FRAME);
 			process.max_out_frames = max_out_frames;
 		}
+
+		process.max_in_frames = max_in_frames;
 		
 		if (!process.inbuf || !process.outbuf) {
 			LOG_ERROR("malloc fail creating process buffers");
@@ -169,22 +222,74 @@ unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supp
 
 // process flush - called with decode mutex set
 void process_flush(void) {
+	int i;
 
 	LOG_INFO("process flush");
 
-	FLUSH_FUNC();
+	for (i = 0; i < chain.count; i++) {
+		chain.stage[i]->flush();
+	}
 
 	process.in_frames = 0;
 }
 
-// init - called with no mutex
-void process_init(char *opt) {
+// add a stage given as <name>[:<params>]
+static bool _add_stage(char *spec) {
+	char *opt = strchr(spec, ':');
+	int i;
+
+	if (opt) *opt++ = '\0';
+
+	for (i = 0; stages[i].name && strcasecmp(stages[i].name, spec); i++);
+
+	if (!stages[i].name) {
+		LOG_ERROR("unknown processing stage %s", spec);
+		return false;
+	}
+
+	if (chain.count == MAX_STAGES) {
+		LOG_ERROR("too many processing stages, ignoring %s", spec);
+		return false;
+	}
+
+	if (!stages[i].init(opt ? opt : "")) {
+		LOG_WARN("processing stage %s disabled", spec);
+		return false;
+	}
 
-	bool enabled = INIT_FUNC(opt);
+	chain.stage[chain.count++] = stages + i;
+	LOG_INFO("adding processing stage %s", stages[i].name);
+
+	return true;
+}
+
+// init - called with no mutex
+void process_init(char *resample, char *dsp) {
 
 	memset(&process, 0, sizeof(process));
+	chain.count = 0;
+
+	// legacy -R option means a resample stage first
+	if (resample) {
+		char *spec = malloc(strlen(resample) + sizeof("resample:"));
+		sprintf(spec, "resample:%s", resample);
+		_add_stage(spec);
+		free(spec);
+	}
+
+	// -E <stage>[:<params>],<stage>[:<params>]...
+	if (dsp) {
+		char *list = strdup(dsp), *spec = list;
+		while (spec && *spec) {
+			char *next = strchr(spec, ',');
+			if (next) *next++ = '\0';
+			_add_stage(spec);
+			spec = next;
+		}
+		free(list);
+	}
 
-	if (enabled) {
+	if (chain.count) {
 		LOCK_D;
 		decode.process = true;
 		UNLOCK_D;
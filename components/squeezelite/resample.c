@@ -85,8 +85,6 @@ void resample_samples(struct processstate *process) {
 	}
 	
 	process->out_frames = odone;
-	process->total_in  += idone;
-	process->total_out += odone;
 	
 	clip_cnt = *(SOXR(r, num_clips, r->resampler));
 	if (clip_cnt - r->old_clips) {
@@ -106,7 +104,6 @@ bool resample_drain(struct processstate *process) {
 	}
 	
 	process->out_frames = odone;
-	process->total_out += odone;
 	
 	clip_cnt = *(SOXR(r, num_clips, r->resampler));
 	if (clip_cnt - r->old_clips) {
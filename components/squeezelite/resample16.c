@@ -50,8 +50,6 @@ void resample_samples(struct processstate *process) {
 	}
 	
 	process->out_frames = odone;
-	process->total_in  += process->in_frames;
-	process->total_out += odone;
 }
 
 bool resample_drain(struct processstate *process) {
@@ -45,6 +45,7 @@ static sockfd sock = -1;
 static in_addr_t slimproto_ip = 0;
 
 extern struct buffer *streambuf;
+extern struct buffer *prefetchbuf;
 extern struct buffer *outputbuf;
 
 extern struct streamstate stream;
@@ -86,6 +87,12 @@ static struct {
 
 int autostart;
 bool sentSTMu, sentSTMo, sentSTMl;
+static bool earlySTMd;
+// strm s received after early STMd that can't be prefetched, run once current track is decoded
+static struct {
+	u8_t *pkt;
+	int len;
+} deferred_strm;
 u32_t new_server;
 char *new_server_cap;
 #define PLAYER_NAME_LEN 64
@@ -284,6 +291,9 @@ static void process_strm(u8_t *pkt, int len) {
 		output_flush();
 		status.frames_played = 0;
 		stream_disconnect();
+		earlySTMd = false;
+		free(deferred_strm.pkt);
+		deferred_strm.pkt = NULL;
 		sendSTAT("STMf", 0);
 		buf_flush(streambuf);
 		break;
@@ -294,6 +304,9 @@ static void process_strm(u8_t *pkt, int len) {
 		if (stream_disconnect()) {
 			sendSTAT("STMf", 0);
 		}
+		earlySTMd = false;
+		free(deferred_strm.pkt);
+		deferred_strm.pkt = NULL;
 		buf_flush(streambuf);
 		break;
 	case 'p':
@@ -340,10 +353,30 @@ static void process_strm(u8_t *pkt, int len) {
 			char *header = (char *)(pkt + sizeof(struct strm_packet));
 			in_addr_t ip = (in_addr_t)strm->server_ip; // keep in network byte order
 			u16_t port = strm->server_port; // keep in network byte order
+			bool prefetch, decoding;
 			if (ip == 0) ip = slimproto_ip; 
 
 			LOG_DEBUG("strm s autostart: %c transition period: %u transition type: %u codec: %c", 
 					  strm->autostart, strm->transition_period, strm->transition_type - '0', strm->format);
+
+			// current stream is fully received but not decoded yet, buffer the new one aside
+			prefetch = earlySTMd && prefetchbuf && strm->format != '?' && 
+					   !(ip == LOCAL_PLAYER_IP && port == LOCAL_PLAYER_PORT);
+
+			// otherwise opening it now would flush what's left of current track
+			LOCK_D;
+			decoding = decode.state == DECODE_RUNNING;
+			UNLOCK_D;
+			if (earlySTMd && !prefetch && decoding) {
+				free(deferred_strm.pkt);
+				if ((deferred_strm.pkt = malloc(len)) != NULL) {
+					memcpy(deferred_strm.pkt, pkt, len);
+					deferred_strm.len = len;
+					LOG_INFO("strm s can't be prefetched, deferred until decode completes");
+					break;
+				}
+				LOG_WARN("can't defer strm s, current track will be truncated");
+			}
 			
 			autostart = strm->autostart - '0';
 
@@ -353,7 +386,8 @@ static void process_strm(u8_t *pkt, int len) {
 				break;
 			}
 			if (strm->format != '?') {
-				codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
+				// when prefetching, codec is opened once stream is set so that it can be deferred
+				if (!prefetch) codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
 			} else if (autostart >= 2) {
 				// extension to slimproto to allow server to detect codec from response header and send back in codc message
 				LOG_DEBUG("streaming unknown codec");
@@ -366,20 +400,20 @@ static void process_strm(u8_t *pkt, int len) {
 				stream_file(header, header_len, strm->threshold * 1024);
 				autostart -= 2;
 			} else {
-				stream_sock(ip, port, header, header_len, strm->threshold * 1024, autostart >= 2);
+				stream_sock(ip, port, header, header_len, strm->threshold * 1024, autostart >= 2, prefetch);
+			}
+			if (prefetch) {
+				codec_open(strm->format, strm->pcm_sample_size, strm->pcm_sample_rate, strm->pcm_channels, strm->pcm_endianness);
 			}
 			sendSTAT("STMc", 0);
-			sentSTMu = sentSTMo = sentSTMl = false;
+			sentSTMu = sentSTMo = sentSTMl = earlySTMd = false;
 			LOCK_O;
 			output.external = false;
 			_buf_resize(outputbuf, output.init_size);
 			output.threshold = strm->output_threshold;
-			output.next_replay_gain = unpackN(&strm->replay_gain);
-			output.fade_mode = strm->transition_type - '0';
-			output.fade_secs = strm->transition_period;
-			output.invert    = (strm->flags & 0x03) == 0x03;
-			LOG_DEBUG("set fade mode: %u", output.fade_mode);
 			UNLOCK_O;
+			// when prefetched, current track keeps its own until it is decoded
+			codec_track(unpackN(&strm->replay_gain), strm->transition_type - '0', strm->transition_period, (strm->flags & 0x03) == 0x03);
 		}
 		break;
 	default:
@@ -400,6 +434,7 @@ static void process_cont(u8_t *pkt, int len) {
 		if (stream.state == STREAMING_WAIT) {
 			stream.state = STREAMING_BUFFERING;
 			stream.meta_interval = stream.meta_next = cont->metaint;
+			_buf_wake(streambuf);
 		}
 		UNLOCK_S;
 		wake_controller();
@@ -608,6 +643,21 @@ static void slimproto_run() {
 		// update playback state when woken or every 100ms
 		now = gettime_ms();
 
+		// current track is decoded, can now start the stream that could not be prefetched
+		if (deferred_strm.pkt) {
+			bool decoding;
+			LOCK_D;
+			decoding = decode.state == DECODE_RUNNING;
+			UNLOCK_D;
+			if (!decoding) {
+				u8_t *pkt = deferred_strm.pkt;
+				deferred_strm.pkt = NULL;
+				LOG_INFO("starting deferred strm s");
+				process_strm(pkt, deferred_strm.len);
+				free(pkt);
+			}
+		}
+
 		if (wake || now - last > 100 || last > now) {
 			bool _sendSTMs = false;
 			bool _sendDSCO = false;
@@ -621,6 +671,8 @@ static void slimproto_run() {
 			bool _sendSTMn = false;
 			bool _stream_disconnect = false;
 			bool _start_output = false;
+			bool _decode_start = false;
+			bool _prefetching;
 			decode_state _decode_state;
 			disconnect_code disconnect_code;
 			static char header[MAX_HEADER];
@@ -636,6 +688,7 @@ static void slimproto_run() {
 			status.stream_size = streambuf->size;
 			status.stream_bytes = stream.bytes;
 			status.stream_state = stream.state;
+			_prefetching = stream.prefetch;
 						
 			if (stream.state == DISCONNECT) {
 				disconnect_code = stream.disconnect;
@@ -661,6 +714,7 @@ static void slimproto_run() {
 			if ((status.stream_state == STREAMING_HTTP || status.stream_state == STREAMING_FILE ||
 				(status.stream_state == DISCONNECT && stream.disconnect == DISCONNECT_OK)) &&
 				!sentSTMl && decode.state == DECODE_READY) {
+				_decode_start = true;
 				if (autostart == 0) {
 					decode.state = DECODE_RUNNING;
 					_sendSTMl = true;
@@ -671,8 +725,14 @@ static void slimproto_run() {
 				}
 				// autostart 2 and 3 require cont to be received first
 			}
+			// stream of current track fully received, so let server send the next one while decoding
+			if (prefetchbuf && _sendDSCO && disconnect_code == DISCONNECT_OK && !_prefetching && 
+				decode.state == DECODE_RUNNING && !earlySTMd) {
+				_sendSTMd = true;
+				earlySTMd = true;
+			}
 			if (decode.state == DECODE_COMPLETE || decode.state == DECODE_ERROR) {
-				if (decode.state == DECODE_COMPLETE) _sendSTMd = true;
+				if (decode.state == DECODE_COMPLETE && !earlySTMd) _sendSTMd = true;
 				if (decode.state == DECODE_ERROR)    _sendSTMn = true;
 				decode.state = DECODE_STOPPED;
 				if (status.stream_state == STREAMING_HTTP || status.stream_state == STREAMING_FILE) {
@@ -681,6 +741,8 @@ static void slimproto_run() {
 			}
 			_decode_state = decode.state;
 			UNLOCK_D;
+
+			if (_decode_state == DECODE_RUNNING && _decode_start) decode_wake();
 			
 			LOCK_O;
 			status.output_full = _buf_used(outputbuf);
@@ -119,7 +119,7 @@
 #if defined(RESAMPLE) || defined(RESAMPLE_MP)
 #undef  RESAMPLE
 #define RESAMPLE  1 // resampling
-#define PROCESS   1 // any sample processing (only resampling at present)
+#define PROCESS   1 // any sample processing (chain of stages, see process.c)
 #elif defined(RESAMPLE16)
 #undef RESAMPLE16
 #define RESAMPLE16	1
@@ -259,6 +259,7 @@
 #define OUTPUTBUF_SIZE (1450 * 1024)
 #endif
 #define OUTPUTBUF_SIZE_CROSSFADE (OUTPUTBUF_SIZE * 12 / 10)
+#define STREAMBUF_TAIL (32 * 1024) // must hold the largest block a decoder reads in one go
 
 #define MAX_HEADER 4096 // do not reduce as icy-meta max is 4080
 
@@ -337,6 +338,11 @@ typedef int64_t   s64_t;
 #define mutex_lock(m) pthread_mutex_lock(&m)
 #define mutex_unlock(m) pthread_mutex_unlock(&m)
 #define mutex_destroy(m) pthread_mutex_destroy(&m)
+#define cond_type pthread_cond_t
+#define cond_create(c) _cond_create(&c)
+#define cond_signal(c) pthread_cond_signal(&c)
+#define cond_timedwait_ms(c, m, ms) _cond_timedwait_ms(&c, &m, ms)
+#define cond_destroy(c) pthread_cond_destroy(&c)
 #define thread_type pthread_t
 #if !EMBEDDED
 #define pthread_create_name(t,a,f,p,n) pthread_create(t,a,f,p)
@@ -373,6 +379,11 @@ typedef BOOL bool;
 #define mutex_lock(m) WaitForSingleObject(m, INFINITE)
 #define mutex_unlock(m) ReleaseMutex(m)
 #define mutex_destroy(m) CloseHandle(m)
+#define cond_type HANDLE
+#define cond_create(c) c = CreateEvent(NULL, FALSE, FALSE, NULL)
+#define cond_signal(c) SetEvent(c)
+#define cond_timedwait_ms(c, m, ms) { ReleaseMutex(m); WaitForSingleObject(c, ms); WaitForSingleObject(m, INFINITE); }
+#define cond_destroy(c) CloseHandle(c)
 #define thread_type HANDLE
 
 #define usleep(x) Sleep(x/1000)
@@ -468,6 +479,25 @@ void _wake_create(event_event*);
 #endif
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+
+// execute statement n times, unrolled by 4 for sample conversion loops (NO_UNROLL to compare)
+#if NO_UNROLL
+#define UNROLL4(n, statement) do {	\
+	size_t _n = (n);				\
+	while (_n--) { statement; }		\
+} while (0)
+#else
+#define UNROLL4(n, statement) do {	\
+	size_t _n = (n);				\
+	while (_n >= 4) {				\
+		statement; statement;		\
+		statement; statement;		\
+		_n -= 4;					\
+	}								\
+	while (_n--) { statement; }		\
+} while (0)
+#endif
 
 // logging
 typedef enum { lERROR = 0, lWARN, lINFO, lDEBUG, lSDEBUG } log_level;
@@ -519,6 +549,10 @@ int poll(struct pollfd *fds, unsigned long numfds, int timeout);
 #if LINUX || FREEBSD
 void touch_memory(u8_t *buf, size_t size);
 #endif
+#if !WIN
+int _cond_create(pthread_cond_t *cond);
+int _cond_timedwait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, unsigned ms);
+#endif
 
 // buffer.c
 struct buffer {
@@ -528,21 +562,29 @@ struct buffer {
 	u8_t *wrap;
 	size_t size;
 	size_t base_size;
+	size_t tail;
 	mutex_type mutex;
+	cond_type space_cond;
+	unsigned space_low;
+	bool space_wait;
 };
 
-// _* called with mutex locked
+// _* called with mutex locked, except _buf_used/_buf_space/_buf_cont_* which are 
+// safe without it from the single producer or the single consumer
 unsigned _buf_used(struct buffer *buf);
 unsigned _buf_space(struct buffer *buf);
 unsigned _buf_cont_read(struct buffer *buf);
 unsigned _buf_cont_write(struct buffer *buf);
 void _buf_inc_readp(struct buffer *buf, unsigned by);
 void _buf_inc_writep(struct buffer *buf, unsigned by);
+void _buf_wait_space(struct buffer *buf, unsigned low, unsigned ms);
+void _buf_wake(struct buffer *buf);
 void buf_flush(struct buffer *buf);
 void _buf_flush(struct buffer *buf);
 void buf_adjust(struct buffer *buf, size_t mod);
 void _buf_resize(struct buffer *buf, size_t size);
-void buf_init(struct buffer *buf, size_t size);
+void _buf_swap(struct buffer *a, struct buffer *b);
+void buf_init(struct buffer *buf, size_t size, size_t tail);
 void buf_destroy(struct buffer *buf);
 
 // slimproto.c
@@ -568,13 +610,18 @@ struct streamstate {
 	u32_t meta_next;
 	u32_t meta_left;
 	bool  meta_send;
+	bool  prefetch;		// streaming into prefetchbuf while decoder finishes streambuf
 };
 
-void stream_init(log_level level, unsigned stream_buf_size);
+// decoder view: nothing more will come into streambuf (what streams goes to prefetchbuf)
+#define _stream_ended() (stream.state <= DISCONNECT || stream.prefetch)
+
+void stream_init(log_level level, unsigned stream_buf_size, unsigned resume_retries, bool prefetch);
 void stream_close(void);
 void stream_file(const char *header, size_t header_len, unsigned threshold);
-void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait);
+void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait, bool prefetch);
 bool stream_disconnect(void);
+void _stream_swap(void);
 
 // decode.c
 typedef enum { DECODE_STOPPED = 0, DECODE_READY, DECODE_RUNNING, DECODE_COMPLETE, DECODE_ERROR } decode_state;
@@ -597,6 +644,17 @@ struct processstate {
 	unsigned in_sample_rate, out_sample_rate;
 	unsigned long total_in, total_out;
 };
+
+// a stage reads in_frames from inbuf and writes out_frames to outbuf (max_out_frames), 
+// newstream returns false when it would be a no-op so it is bypassed
+struct process_stage {
+	const char *name;
+	bool (*init)(char *opt);
+	bool (*newstream)(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
+	void (*samples)(struct processstate *process);
+	bool (*drain)(struct processstate *process);
+	void (*flush)(void);
+};
 #endif
 
 struct codec {
@@ -613,7 +671,11 @@ void decode_init(log_level level, const char *include_codecs, const char *exclud
 void decode_close(void);
 void decode_flush(void);
 unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]);
+void decode_wake(void);
+void decode_wake_bytes(unsigned bytes);
+void decode_wake_space(unsigned space);
 void codec_open(u8_t format, u8_t sample_size, u8_t sample_rate, u8_t channels, u8_t endianness);
+void codec_track(u32_t replay_gain, u8_t fade_mode, u8_t fade_secs, bool invert);
 
 #if PROCESS
 // process.c
@@ -621,7 +683,23 @@ void process_samples(void);
 void process_drain(void);
 void process_flush(void);
 unsigned process_newstream(bool *direct, unsigned raw_sample_rate, unsigned supported_rates[]);
-void process_init(char *opt);
+void process_init(char *resample, char *dsp);
+#endif
+
+#if PROCESS
+// eq.c
+void eq_samples(struct processstate *process);
+bool eq_drain(struct processstate *process);
+bool eq_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
+void eq_flush(void);
+bool eq_init(char *opt);
+
+// fir.c
+void fir_samples(struct processstate *process);
+bool fir_drain(struct processstate *process);
+bool fir_newstream(struct processstate *process, unsigned raw_sample_rate, unsigned supported_rates[]);
+void fir_flush(void);
+bool fir_init(char *opt);
 #endif
 
 #if RESAMPLE || RESAMPLE16
@@ -633,6 +711,20 @@ void resample_flush(void);
 bool resample_init(char *opt);
 #endif
 
+// drift.c
+struct drift;
+struct drift *drift_create(void);
+void drift_delete(struct drift *d);
+void drift_reset(struct drift *d);
+void drift_error(struct drift *d, s32_t error);
+s32_t drift_ppm(struct drift *d);
+frames_t drift_resample(struct drift *d, ISAMPLE_T *iptr, frames_t in_frames, ISAMPLE_T *optr, frames_t out_frames, frames_t *consumed);
+#if BYTES_PER_FRAME == 4
+#define drift_resample16 drift_resample
+#else
+frames_t drift_resample16(struct drift *d, s16_t *iptr, frames_t in_frames, ISAMPLE_T *optr, frames_t out_frames, frames_t *consumed);
+#endif
+
 // output.c output_alsa.c output_pa.c output_pack.c
 typedef enum { OUTPUT_OFF = -1, OUTPUT_STOPPED = 0, OUTPUT_BUFFER, OUTPUT_RUNNING, 
 			   OUTPUT_PAUSE_FRAMES, OUTPUT_SKIP_FRAMES, OUTPUT_START_AT } output_state;
@@ -647,6 +739,7 @@ typedef enum { S32_LE, S24_LE, S24_3LE, S16_LE, S24_BE, S24_3BE, S16_BE, S8_BE }
 typedef enum { FADE_INACTIVE = 0, FADE_DUE, FADE_ACTIVE } fade_state;
 typedef enum { FADE_UP = 1, FADE_DOWN, FADE_CROSS } fade_dir;
 typedef enum { FADE_NONE = 0, FADE_CROSSFADE, FADE_IN, FADE_OUT, FADE_INOUT } fade_mode;
+typedef enum { DITHER_OFF = 0, DITHER_TPDF, DITHER_SHAPED } dither_mode;
 
 #define MAX_SUPPORTED_SAMPLERATES 18
 #define TEST_RATES = { 768000, 705600, 384000, 352800, 192000, 176400, 96000, 88200, 48000, 44100, 32000, 24000, 22500, 16000, 12000, 11025, 8000, 0 }
@@ -699,6 +792,7 @@ struct outputstate {
 	fade_mode fade_mode;       // set by slimproto
 	unsigned fade_secs;        // set by slimproto
 	unsigned rate_delay;
+	dither_mode dither;        // when narrowing to 16 bits
 	bool delay_active;
 	u32_t stop_time;
 	u32_t idle_to;
@@ -741,7 +835,7 @@ void _pa_open(void);
 #if EMBEDDED
 void set_volume(unsigned left, unsigned right);
 bool test_open(const char *device, unsigned rates[], bool userdef_rates);
-void output_init_embedded(log_level level, char *device, unsigned output_buf_size, char *params, unsigned rates[], unsigned rate_delay, unsigned idle);
+void output_init_embedded(log_level level, char *device, unsigned output_buf_size, char *params, unsigned rates[], unsigned rate_delay, unsigned idle, dither_mode dither);
 void output_close_embedded(void);
 #else 
 // output_stdout.c
@@ -753,6 +847,8 @@ void output_close_stdout(void);
 void _scale_and_pack_frames(void *outputptr, s32_t *inputptr, frames_t cnt, s32_t gainL, s32_t gainR, output_format format);
 void _apply_cross(struct buffer *outputbuf, frames_t out_frames, s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr);
 void _apply_gain(struct buffer *outputbuf, frames_t count, s32_t gainL, s32_t gainR);
+void _cross_scale_and_pack_frames(void *outputptr, struct buffer *outputbuf, frames_t cnt, s32_t gainL, s32_t gainR, 
+								  s32_t cross_gain_in, s32_t cross_gain_out, ISAMPLE_T **cross_ptr, output_format format);
 s32_t gain(s32_t gain, s32_t sample);
 s32_t to_gain(float f);
 
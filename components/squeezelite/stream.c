@@ -37,13 +37,34 @@
 #endif
 static log_level loglevel;
 
-static struct buffer buf;
+static struct buffer buf, nextbuf;
 struct buffer *streambuf = &buf;
+struct buffer *prefetchbuf;
 
 #define LOCK   mutex_lock(streambuf->mutex)
 #define UNLOCK mutex_unlock(streambuf->mutex)
 
+// don't wake up for less than that when streambuf is full
+#define SPACE_LOW_MARK	(16 * 1024)
+#define WAIT_TIMEOUT	100
+
+// resume HTTP streams with a Range request after a remote disconnect
+#define RESUME_BACKOFF		250
+#define RESUME_BACKOFF_MAX	4000
+
 static sockfd fd;
+static u32_t session, connect_time;
+
+static struct {
+	unsigned max, count;
+	struct sockaddr_in addr;
+	char *request;
+	bool active;				// waiting for the response to a resume request
+	stream_state state;			// state to restore once resumed
+	u64_t offset, end;			// offset of original request, expected end of body (0 = unknown)
+	bool bounded;				// original Range has a last byte, kept when resuming
+	u64_t last;
+} resume;
 
 struct streamstate stream;
 
@@ -63,7 +84,8 @@ SSL *ssl;
 static int _recv(SSL *ssl, int fd, void *buffer, size_t bytes, int options) {
 	int n;
 	if (!ssl) return recv(fd, buffer, bytes, options);
-	n = SSL_read(ssl, (u8_t*) buffer, bytes);
+	if (options & MSG_PEEK) n = SSL_peek(ssl, (u8_t*) buffer, bytes);
+	else n = SSL_read(ssl, (u8_t*) buffer, bytes);
 	if (n <= 0 && SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN) return 0;
 	return n;
 }
@@ -131,6 +153,8 @@ static bool send_header(void) {
 
 static bool running = true;
 
+static sockfd connect_socket(struct sockaddr_in *addr, const char *header, void **sslp);
+
 static void _disconnect(stream_state state, disconnect_code disconnect) {
 	stream.state = state;
 	stream.disconnect = disconnect;
@@ -144,6 +168,89 @@ static void _disconnect(stream_state state, disconnect_code disconnect) {
 	closesocket(fd);
 	fd = -1;
 	wake_controller();
+	decode_wake();
+}
+
+static bool _stream_resume(void) {
+	// must be called with streambuf mutex held, returns false if stream can't be resumed
+	u32_t _session = session;
+	char *p, *q;
+	size_t len = 0;
+	sockfd sock = -1;
+	void *_ssl;
+
+	if (stream.cont_wait || stream.meta_interval || !resume.request || resume.count >= resume.max ||
+		(!resume.active && stream.state != STREAMING_HTTP && stream.state != STREAMING_BUFFERING)) {
+		return false;
+	}
+
+	// copy original request without its Range field and add ours before the empty line
+	for (p = resume.request; *p; p = q) {
+		q = strstr(p, "\r\n");
+		q = q ? q + 2 : p + strlen(p);
+		if (q - p == 2) break;
+		if (len + (q - p) > MAX_HEADER - 64) return false;
+		if (strncasecmp(p, "Range:", 6)) {
+			memcpy(stream.header + len, p, q - p);
+			len += q - p;
+		}
+	}
+	len += sprintf(stream.header + len, "Range: bytes=%llu-", (unsigned long long) (resume.offset + stream.bytes));
+	if (resume.bounded) len += sprintf(stream.header + len, "%llu", (unsigned long long) resume.last);
+	len += sprintf(stream.header + len, "\r\n\r\n");
+
+	if (!resume.active) resume.state = stream.state;
+	resume.active = true;
+
+#if USE_SSL
+	if (ssl) {
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+		ssl = NULL;
+	}
+#endif
+	closesocket(fd);
+	fd = -1;
+	stream.state = SEND_HEADERS;
+
+	while (sock < 0 && resume.count < resume.max) {
+		unsigned backoff = min(RESUME_BACKOFF << resume.count, RESUME_BACKOFF_MAX);
+
+		resume.count++;
+		LOG_INFO("resuming stream at %llu in %u ms (%u/%u)", (unsigned long long) (resume.offset + stream.bytes), 
+				 backoff, resume.count, resume.max);
+
+		// don't hold the lock while connecting, stream might be closed or restarted meanwhile
+		UNLOCK;
+		usleep(backoff * 1000);
+		sock = connect_socket(&resume.addr, resume.request, &_ssl);
+		LOCK;
+
+		if (_session != session || stream.state != SEND_HEADERS) {
+			if (sock >= 0) {
+#if USE_SSL
+				if (_ssl) SSL_free(_ssl);
+#endif
+				closesocket(sock);
+			}
+			return true;
+		}
+	}
+
+	if (sock < 0) {
+		LOG_WARN("unable to resume stream");
+		resume.active = false;
+		return false;
+	}
+
+	fd = sock;
+#if USE_SSL
+	ssl = _ssl;
+#endif
+	stream.header_len = len;
+	connect_time = gettime_ms();
+
+	return true;
 }
 
 static void *stream_thread() {
@@ -151,28 +258,45 @@ static void *stream_thread() {
 	while (running) {
 
 		struct pollfd pollinfo;
+		struct buffer *sbuf;
 		size_t space;
 
 		LOCK;
 
-		space = min(_buf_space(streambuf), _buf_cont_write(streambuf));
+		// when prefetching, decoder still owns streambuf
+		sbuf = stream.prefetch ? prefetchbuf : streambuf;
+		space = min(_buf_space(sbuf), _buf_cont_write(sbuf));
 
 		if (fd < 0 || !space || stream.state <= STREAMING_WAIT) {
+			// wait for consumer to free enough space or for a state change (nobody reads prefetchbuf)
+			_buf_wait_space(streambuf, space || stream.prefetch ? streambuf->size : SPACE_LOW_MARK, WAIT_TIMEOUT);
 			UNLOCK;
-			usleep(space ? 100000 : 25000);
 			continue;
 		}
 
 		if (stream.state == STREAMING_FILE) {
+			u32_t _session = session;
+			int n, _fd = fd;
+
+			// do not hold the lock while reading, we are the only writer of that area
+			UNLOCK;
+			n = read(_fd, sbuf->writep, space);
+			LOCK;
+
+			// stream has been restarted or closed while reading
+			if (_session != session || stream.state != STREAMING_FILE) {
+				UNLOCK;
+				continue;
+			}
 
-			int n = read(fd, streambuf->writep, space);
 			if (n == 0) {
 				LOG_INFO("end of stream");
 				_disconnect(DISCONNECT, DISCONNECT_OK);
 			}
 			if (n > 0) {
-				_buf_inc_writep(streambuf, n);
+				_buf_inc_writep(sbuf, n);
 				stream.bytes += n;
+				decode_wake_bytes(_buf_used(sbuf));
 				LOG_SDEBUG("streambuf read %d bytes", n);
 			}
 			if (n < 0) {
@@ -216,40 +340,63 @@ static void *stream_thread() {
 				// get response headers
 				if (stream.state == RECV_HEADERS) {
 
-					// read one byte at a time to catch end of header
-					char c;
+					// peek at what is available and only consume up to the end of headers so 
+					// that body is left in the socket (it might start with icy meta data)
 					static int endtok;
+					char *ptr = stream.header + stream.header_len;
+					int i, n;
+					
+					if (!stream.header_len) endtok = 0;
 
-					int n = _recv(ssl, fd, &c, 1, 0);
+					n = _recv(ssl, fd, ptr, MAX_HEADER - 1 - stream.header_len, MSG_PEEK);
 					if (n <= 0) {
 						if (n < 0 && _last_error() == ERROR_WOULDBLOCK) {
 							UNLOCK;
 							continue;
 						}
 						LOG_INFO("error reading headers: %s", n ? strerror(last_error()) : "closed");
-						_disconnect(STOPPED, LOCAL_DISCONNECT);
+						if (!resume.active) _disconnect(STOPPED, LOCAL_DISCONNECT);
+						else if (!_stream_resume()) _disconnect(DISCONNECT, REMOTE_DISCONNECT);
 						UNLOCK;
 						continue;
 					}
 
-					*(stream.header + stream.header_len) = c;
-					stream.header_len++;
-
-					if (stream.header_len > MAX_HEADER - 1) {
-						LOG_ERROR("received headers too long: %u", stream.header_len);
-						_disconnect(DISCONNECT, LOCAL_DISCONNECT);
+					for (i = 0; i < n && endtok < 4; i++) {
+						if (stream.header_len + i > 0 && (ptr[i] == '\r' || ptr[i] == '\n')) endtok++;
+						else endtok = 0;
 					}
 
-					if (stream.header_len > 1 && (c == '\r' || c == '\n')) {
-						endtok++;
-						if (endtok == 4) {
-							*(stream.header + stream.header_len) = '\0';
-							LOG_INFO("headers: len: %d\n%s", stream.header_len, stream.header);
+					// now really read, we know that these bytes are available
+					n = _recv(ssl, fd, ptr, i, 0);
+					if (n > 0) stream.header_len += n;
+
+					if (n != i) {
+						LOG_INFO("error reading headers: %s", n ? strerror(last_error()) : "closed");
+						if (!resume.active) _disconnect(STOPPED, LOCAL_DISCONNECT);
+						else if (!_stream_resume()) _disconnect(DISCONNECT, REMOTE_DISCONNECT);
+					} else if (endtok == 4) {
+						char *p, *code;
+						*(stream.header + stream.header_len) = '\0';
+						LOG_INFO("headers: len: %d (%u ms)\n%s", stream.header_len, gettime_ms() - connect_time, stream.header);
+						p = strcasestr(stream.header, "Content-Length:");
+						code = strchr(stream.header, ' ');
+						resume.end = (p && resume.request) ? stream.bytes + strtoull(p + 15, NULL, 10) : 0;
+						if (!resume.active) {
 							stream.state = stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
 							wake_controller();
+						} else if (!code || strncmp(code, " 206", 4)) {
+							// server restarted from the beginning or refused, we can't splice that
+							LOG_WARN("server can't resume stream");
+							resume.active = false;
+							_disconnect(DISCONNECT, REMOTE_DISCONNECT);
+						} else {
+							LOG_INFO("stream resumed at %llu", (unsigned long long) (resume.offset + stream.bytes));
+							resume.active = false;
+							stream.state = resume.state;
 						}
-					} else {
-						endtok = 0;
+					} else if (stream.header_len >= MAX_HEADER - 1) {
+						LOG_ERROR("received headers too long: %u", stream.header_len);
+						_disconnect(DISCONNECT, LOCAL_DISCONNECT);
 					}
 				
 					UNLOCK;
@@ -310,24 +457,32 @@ static void *stream_thread() {
 				} else {
 					int n;
 
-					space = min(_buf_space(streambuf), _buf_cont_write(streambuf));
+					sbuf = stream.prefetch ? prefetchbuf : streambuf;
+					space = min(_buf_space(sbuf), _buf_cont_write(sbuf));
 					if (stream.meta_interval) {
 						space = min(space, stream.meta_next);
 					}
 					
-					n = _recv(ssl, fd, streambuf->writep, space, 0);
+					n = _recv(ssl, fd, sbuf->writep, space, 0);
 					if (n == 0) {
-						LOG_INFO("end of stream");
-						_disconnect(DISCONNECT, DISCONNECT_OK);
+						if (stream.bytes < resume.end) {
+							LOG_INFO("stream closed at %llu, expecting %llu", (unsigned long long) stream.bytes, (unsigned long long) resume.end);
+							if (!_stream_resume()) _disconnect(DISCONNECT, REMOTE_DISCONNECT);
+						} else {	
+							LOG_INFO("end of stream");
+							_disconnect(DISCONNECT, DISCONNECT_OK);
+						}	
 					}
 					if (n < 0 && _last_error() != ERROR_WOULDBLOCK) {
 						LOG_INFO("error reading: %s", strerror(last_error()));
-						_disconnect(DISCONNECT, REMOTE_DISCONNECT);
+						if (!_stream_resume()) _disconnect(DISCONNECT, REMOTE_DISCONNECT);
 					}
 					
 					if (n > 0) {
-						_buf_inc_writep(streambuf, n);
+						resume.count = 0;
+						_buf_inc_writep(sbuf, n);
 						stream.bytes += n;
+						if (!stream.prefetch) decode_wake_bytes(_buf_used(sbuf));
 						if (stream.meta_interval) {
 							stream.meta_next -= n;
 						}
@@ -364,17 +519,24 @@ static void *stream_thread() {
 
 static thread_type thread;
 
-void stream_init(log_level level, unsigned stream_buf_size) {
+void stream_init(log_level level, unsigned stream_buf_size, unsigned resume_retries, bool prefetch) {
 	loglevel = level;
 
 	LOG_INFO("init stream");
 	LOG_DEBUG("streambuf size: %u", stream_buf_size);
 
-	buf_init(streambuf, stream_buf_size);
+	buf_init(streambuf, stream_buf_size, STREAMBUF_TAIL);
 	if (streambuf->buf == NULL) {
 		LOG_ERROR("unable to malloc buffer");
 		exit(0);
 	}
+
+	// next track is buffered here while current one is decoded from streambuf
+	if (prefetch) {
+		buf_init(&nextbuf, stream_buf_size, STREAMBUF_TAIL);
+		if (nextbuf.buf) prefetchbuf = &nextbuf;
+		else LOG_WARN("unable to malloc prefetch buffer");
+	}
 	
 #if USE_SSL
 #if !LINKALL && !NO_SSLSYM
@@ -400,6 +562,12 @@ void stream_init(log_level level, unsigned stream_buf_size) {
 	stream.header = malloc(MAX_HEADER);
 	*stream.header = '\0';
 
+	resume.max = resume_retries;
+	if (resume.max) {
+		LOG_INFO("resume HTTP streams up to %u times", resume.max);
+		resume.request = malloc(MAX_HEADER);
+	}
+
 	fd = -1;
 
 #if LINUX || FREEBSD
@@ -424,11 +592,14 @@ void stream_close(void) {
 	LOG_INFO("close stream");
 	LOCK;
 	running = false;
+	_buf_wake(streambuf);
 	UNLOCK;
 #if LINUX || OSX || FREEBSD || EMBEDDED
 	pthread_join(thread, NULL);
 #endif
 	free(stream.header);
+	if (resume.request) free(resume.request);
+	if (prefetchbuf) buf_destroy(prefetchbuf);
 	buf_destroy(streambuf);
 }
 
@@ -450,10 +621,12 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 #endif
 
 	stream.state = STREAMING_FILE;
+	session++;
 	if (fd < 0) {
 		LOG_INFO("can't open file: %s", stream.header);
 		stream.state = DISCONNECT;
 	}
+	_buf_wake(streambuf);
 	wake_controller();
 	
 	stream.cont_wait = false;
@@ -463,46 +636,42 @@ void stream_file(const char *header, size_t header_len, unsigned threshold) {
 	stream.meta_send = false;
 	stream.sent_headers = false;
 	stream.bytes = 0;
+	stream.prefetch = false;
 	stream.threshold = threshold;
 
+	resume.active = false;
+	resume.end = 0;
+
 	UNLOCK;
 }
 
-void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait) {
-	struct sockaddr_in addr;
-
+static sockfd connect_socket(struct sockaddr_in *addr, const char *header, void **sslp) {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 
+	*sslp = NULL;
+
 	if (sock < 0) {
 		LOG_ERROR("failed to create socket");
-		return;
+		return -1;
 	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = ip;
-	addr.sin_port = port;
-
-	LOG_INFO("connecting to %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	LOG_INFO("connecting to %s:%d", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
 
 	set_nonblock(sock);
 	set_nosigpipe(sock);
 
-	if (connect_timeout(sock, (struct sockaddr *) &addr, sizeof(addr), 10) < 0) {
+	if (connect_timeout(sock, (struct sockaddr *) addr, sizeof(*addr), 10) < 0) {
 		LOG_INFO("unable to connect to server");
-		LOCK;
-		stream.state = DISCONNECT;
-		stream.disconnect = UNREACHABLE;
-		UNLOCK;
-		return;
+		closesocket(sock);
+		return -1;
 	}
 	
 #if USE_SSL
-	if (ntohs(port) == 443) {
+	if (ntohs(addr->sin_port) == 443) {
 		char *server = strcasestr(header, "Host:");
+		SSL *_ssl = SSL_new(SSLctx);
 
-		ssl = SSL_new(SSLctx);
-		SSL_set_fd(ssl, sock);
+		SSL_set_fd(_ssl, sock);
 
 		// add SNI
 		if (server) {
@@ -510,7 +679,7 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 
 			sscanf(server, "Host:%255[^:]s", servername);
 			for (p = servername; *p == ' '; p++);
-			SSL_set_tlsext_host_name(ssl, p);
+			SSL_set_tlsext_host_name(_ssl, p);
 			free(servername);
 		}
 		
@@ -518,38 +687,65 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 			int status, err = 0;
 
 			ERR_clear_error();
-			status = SSL_connect(ssl);
+			status = SSL_connect(_ssl);
 
 			// successful negotiation
 			if (status == 1) break;
 
 			// error or non-blocking requires more time
 			if (status < 0) {
-				err = SSL_get_error(ssl, status);
+				err = SSL_get_error(_ssl, status);
 				if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) continue;
 			}
 
 			LOG_WARN("unable to open SSL socket %d (%d)", status, err);
 			closesocket(sock);
-			SSL_free(ssl);
-			ssl = NULL;
-			LOCK;
-			stream.state = DISCONNECT;
-			stream.disconnect = UNREACHABLE;
-			UNLOCK;
+			SSL_free(_ssl);
 
-			return;
+			return -1;
 		}
-	} else {
-		ssl = NULL;	
+
+		*sslp = _ssl;
 	}
 #endif
 
-	buf_flush(streambuf);
+	return sock;
+}
+
+void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, unsigned threshold, bool cont_wait, bool prefetch) {
+	struct sockaddr_in addr;
+	void *_ssl;
+	sockfd sock;
+
+	connect_time = gettime_ms();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port = port;
+
+	sock = connect_socket(&addr, header, &_ssl);
+
+	if (sock < 0) {
+		LOCK;
+		stream.state = DISCONNECT;
+		stream.disconnect = UNREACHABLE;
+		UNLOCK;
+		return;
+	}
+
+#if USE_SSL
+	ssl = _ssl;
+#endif
+
+	prefetch = prefetch && prefetchbuf;
+	buf_flush(prefetch ? prefetchbuf : streambuf);
 
 	LOCK;
 
 	fd = sock;
+	session++;
+	_buf_wake(streambuf);
 	stream.state = SEND_HEADERS;
 	stream.cont_wait = cont_wait;
 	stream.meta_interval = 0;
@@ -565,6 +761,24 @@ void stream_sock(u32_t ip, u16_t port, const char *header, size_t header_len, un
 	stream.sent_headers = false;
 	stream.bytes = 0;
 	stream.threshold = threshold;
+	stream.prefetch = prefetch;
+
+	if (prefetch) LOG_INFO("prefetching next stream");
+
+	// keep original request and server to be able to resume that stream
+	resume.active = false;
+	resume.count = 0;
+	resume.end = 0;
+	if (resume.request) {
+		char *p;
+		resume.addr = addr;
+		memcpy(resume.request, header, header_len);
+		*(resume.request + header_len) = '\0';
+		p = strcasestr(resume.request, "Range: bytes=");
+		resume.offset = p ? strtoull(p + 13, &p, 10) : 0;
+		resume.bounded = p && *p == '-' && *(p + 1) >= '0' && *(p + 1) <= '9';
+		resume.last = resume.bounded ? strtoull(p + 1, NULL, 10) : 0;
+	}
 
 	UNLOCK;
 }
@@ -584,7 +798,22 @@ bool stream_disconnect(void) {
 		fd = -1;
 		disc = true;
 	}
+	// a resume is pending (socket is closed during backoff), controller still expects the stream
+	if (resume.active) {
+		resume.active = false;
+		disc = true;
+	}
 	stream.state = STOPPED;
+	stream.prefetch = false;
 	UNLOCK;
 	return disc;
 }
+
+// decoder is done with streambuf, hand it what has been prefetched (streambuf mutex held)
+void _stream_swap(void) {
+	if (!stream.prefetch) return;
+	_buf_swap(streambuf, prefetchbuf);
+	stream.prefetch = false;
+	LOG_INFO("swapped to prefetched stream (%u bytes)", _buf_used(streambuf));
+	_buf_wake(streambuf);
+}
@@ -529,6 +529,43 @@ void touch_memory(u8_t *buf, size_t size) {
 }
 #endif
 
+#if !WIN
+// conditions wait on monotonic clock when possible so that SNTP steps do not change timeouts
+static clockid_t cond_clock = CLOCK_REALTIME;
+
+int _cond_create(pthread_cond_t *cond) {
+#if !OSX
+	pthread_condattr_t attr;
+	int rc;
+
+	pthread_condattr_init(&attr);
+	if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0) cond_clock = CLOCK_MONOTONIC;
+	else pthread_condattr_setclock(&attr, cond_clock);
+	rc = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return rc;
+#else
+	return pthread_cond_init(cond, NULL);
+#endif
+}
+
+// wait on condition for at most ms, called with mutex locked
+int _cond_timedwait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, unsigned ms) {
+	struct timespec ts;
+
+	clock_gettime(cond_clock, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	return pthread_cond_timedwait(cond, mutex, &ts);
+}
+#endif
+
 #if WIN && USE_SSL
 char *strcasestr(const char *haystack, const char *needle) {
 	size_t length_needle;
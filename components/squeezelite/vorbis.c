@@ -138,7 +138,7 @@ static decode_state vorbis_decode(void) {
 
 	LOCK_S;
 
-	if (stream.state <= DISCONNECT && !_buf_used(streambuf)) {
+	if (_stream_ended() && !_buf_used(streambuf)) {
 		UNLOCK_S;
 		return DECODE_COMPLETE;
 	}
@@ -266,7 +266,7 @@ static decode_state vorbis_decode(void) {
 
 	} else if (n == 0) {
 
-		if (stream.state <= DISCONNECT) {
+		if (_stream_ended()) {
 			LOG_INFO("partial decode");
 			UNLOCK_O_direct;
 			UNLOCK_S;
@@ -34,6 +34,7 @@
 #include "esp_err.h"
 #include "esp_log.h"
 #include "esp_pm.h"
+#include "esp_timer.h"
 
 static const char* I2S_TAG = "I2S";
 
@@ -66,6 +67,12 @@ typedef struct {
     SemaphoreHandle_t mux;
     xQueueHandle queue;
     lldesc_t **desc;
+    volatile int sending;       /*!< index of the buffer being sent by the DMA */
+    volatile bool running;      /*!< DMA is sending */
+    bool pooled;                /*!< buffers and descriptors belong to the tx pool */
+    volatile int64_t eof_time;  /*!< time of the last out_eof, in us */
+    volatile int filled;        /*!< buffers holding data not yet sent, the one being written included */
+    int write_idx;              /*!< index of the buffer being written */
 } i2s_dma_t;
 
 /**
@@ -90,6 +97,10 @@ typedef struct {
     bool tx_desc_auto_clear;    /*!< I2S auto clear tx descriptor on underflow */
     int fixed_mclk;             /*!< I2S fixed MLCK clock */
     double real_rate;
+    char *tx_pool;              /*!< memory for tx buffers when geometry is set by i2s_set_tx_geometry */
+    lldesc_t *tx_pool_desc;     /*!< descriptors for tx buffers in pool */
+    size_t tx_pool_size;        /*!< size of the tx pool */
+    int tx_pool_count;          /*!< number of descriptors in tx pool */
 #ifdef CONFIG_PM_ENABLE
     esp_pm_lock_handle_t pm_lock;
 #endif
@@ -584,6 +595,20 @@ static void IRAM_ATTR i2s_intr_handler_default(void *arg)
 
     if (i2s_reg->int_st.out_eof && p_i2s->tx) {
         finish_desc = (lldesc_t*) i2s_reg->out_eof_des_addr;
+        // track which buffer the DMA moved to, so that queued data can be measured
+        for (int i = 0; i < p_i2s->dma_buf_count; i++) {
+            if (p_i2s->tx->desc[i] == finish_desc) {
+                I2S_ENTER_CRITICAL_ISR();
+                p_i2s->tx->sending = (i + 1) % p_i2s->dma_buf_count;
+                p_i2s->tx->eof_time = esp_timer_get_time();
+                // data buffers are sent in ring order, so the oldest one is the only candidate
+                if (p_i2s->tx->filled && i == (p_i2s->tx->write_idx - p_i2s->tx->filled + 1 + p_i2s->dma_buf_count) % p_i2s->dma_buf_count) {
+                    p_i2s->tx->filled--;
+                }
+                I2S_EXIT_CRITICAL_ISR();
+                break;
+            }
+        }
         // All buffers are empty. This means we have an underflow on our hands.
         if (xQueueIsQueueFullFromISR(p_i2s->tx->queue)) {
             xQueueReceiveFromISR(p_i2s->tx->queue, &dummy, &high_priority_task_awoken);
@@ -637,7 +662,7 @@ static esp_err_t i2s_destroy_dma_queue(i2s_port_t i2s_num, i2s_dma_t *dma)
         ESP_LOGE(I2S_TAG, "dma is NULL");
         return ESP_ERR_INVALID_ARG;
     }
-    for (bux_idx = 0; bux_idx < p_i2s_obj[i2s_num]->dma_buf_count; bux_idx++) {
+    for (bux_idx = 0; !dma->pooled && bux_idx < p_i2s_obj[i2s_num]->dma_buf_count; bux_idx++) {
         if (dma->desc && dma->desc[bux_idx]) {
             free(dma->desc[bux_idx]);
         }
@@ -741,6 +766,11 @@ esp_err_t i2s_start(i2s_port_t i2s_num)
     esp_intr_disable(p_i2s_obj[i2s_num]->i2s_isr_handle);
     I2S[i2s_num]->int_clr.val = 0xFFFFFFFF;
     if (p_i2s_obj[i2s_num]->mode & I2S_MODE_TX) {
+        if (p_i2s_obj[i2s_num]->tx) {
+            p_i2s_obj[i2s_num]->tx->sending = 0;
+            p_i2s_obj[i2s_num]->tx->eof_time = esp_timer_get_time();
+            p_i2s_obj[i2s_num]->tx->running = true;
+        }
         i2s_enable_tx_intr(i2s_num);
         I2S[i2s_num]->out_link.start = 1;
         I2S[i2s_num]->conf.tx_start = 1;
@@ -764,6 +794,9 @@ esp_err_t i2s_stop(i2s_port_t i2s_num)
         I2S[i2s_num]->out_link.stop = 1;
         I2S[i2s_num]->conf.tx_start = 0;
         i2s_disable_tx_intr(i2s_num);
+        if (p_i2s_obj[i2s_num]->tx) {
+            p_i2s_obj[i2s_num]->tx->running = false;
+        }
     }
     if (p_i2s_obj[i2s_num]->mode & I2S_MODE_RX) {
         I2S[i2s_num]->in_link.stop = 1;
@@ -1115,6 +1148,163 @@ esp_err_t i2s_zero_dma_buffer(i2s_port_t i2s_num)
     return ESP_OK;
 }
 
+/*
+ * Wait for the DMA to send everything that has been written. The last buffer is 
+ * completed with silence and buffers released meanwhile are cleared, so that the 
+ * DMA only loops over silence once this returns. It must be running.
+ */
+esp_err_t i2s_drain_tx(i2s_port_t i2s_num, TickType_t ticks_to_wait)
+{
+    I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((p_i2s_obj[i2s_num] && p_i2s_obj[i2s_num]->tx), "tx NULL", ESP_ERR_INVALID_ARG);
+    i2s_dma_t *tx = p_i2s_obj[i2s_num]->tx;
+    esp_err_t err = ESP_OK;
+    char *ptr;
+
+    xSemaphoreTake(tx->mux, (portTickType)portMAX_DELAY);
+    if (tx->curr_ptr) {
+        memset((char*) tx->curr_ptr + tx->rw_pos, 0, tx->buf_size - tx->rw_pos);
+        tx->rw_pos = tx->buf_size;
+        // buffers come back in ring order, the last one written comes back last
+        do {
+            if (xQueueReceive(tx->queue, &ptr, ticks_to_wait) == pdFALSE) {
+                err = ESP_ERR_TIMEOUT;
+                break;
+            }
+            memset(ptr, 0, tx->buf_size);
+        } while (ptr != tx->curr_ptr);
+        tx->curr_ptr = NULL;
+        I2S_ENTER_CRITICAL();
+        tx->filled = 0;
+        I2S_EXIT_CRITICAL();
+    }
+    xSemaphoreGive(tx->mux);
+    return err;
+}
+
+/*
+ * Stop the DMA and make all buffers but one (as the DMA needs something to send) 
+ * available to i2s_write, cleared and in ring order, so that they can be primed 
+ * before i2s_start. Writing more than that before starting would block forever.
+ */
+esp_err_t i2s_reset_tx(i2s_port_t i2s_num)
+{
+    I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((p_i2s_obj[i2s_num] && p_i2s_obj[i2s_num]->tx), "tx NULL", ESP_ERR_INVALID_ARG);
+    i2s_dma_t *tx = p_i2s_obj[i2s_num]->tx;
+
+    xSemaphoreTake(tx->mux, (portTickType)portMAX_DELAY);
+    i2s_stop(i2s_num);
+    xQueueReset(tx->queue);
+    for (int i = 0; i < p_i2s_obj[i2s_num]->dma_buf_count; i++) {
+        memset(tx->buf[i], 0, tx->buf_size);
+        if (i < p_i2s_obj[i2s_num]->dma_buf_count - 1) {
+            xQueueSend(tx->queue, &tx->buf[i], 0);
+        }
+    }
+    tx->curr_ptr = NULL;
+    tx->rw_pos = 0;
+    tx->sending = 0;
+    tx->filled = 0;
+    xSemaphoreGive(tx->mux);
+    return ESP_OK;
+}
+
+/*
+ * Allocate once the memory for tx buffers (size bytes) and for up to max_count 
+ * descriptors, so that geometry can be changed later without fragmenting the heap 
+ * or failing to find a large enough block of DMA-capable memory.
+ */
+esp_err_t i2s_alloc_tx_pool(i2s_port_t i2s_num, size_t size, int max_count)
+{
+    I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((p_i2s_obj[i2s_num] != NULL), "Not initialized yet", ESP_ERR_INVALID_STATE);
+    I2S_CHECK((p_i2s_obj[i2s_num]->tx_pool == NULL), "tx pool already allocated", ESP_ERR_INVALID_STATE);
+    i2s_obj_t *p_i2s = p_i2s_obj[i2s_num];
+
+    p_i2s->tx_pool = (char*) heap_caps_calloc(1, size, MALLOC_CAP_DMA);
+    p_i2s->tx_pool_desc = (lldesc_t*) heap_caps_calloc(max_count, sizeof(lldesc_t), MALLOC_CAP_DMA);
+    if (p_i2s->tx_pool == NULL || p_i2s->tx_pool_desc == NULL) {
+        ESP_LOGE(I2S_TAG, "Error malloc tx pool");
+        free(p_i2s->tx_pool);
+        free(p_i2s->tx_pool_desc);
+        p_i2s->tx_pool = NULL;
+        p_i2s->tx_pool_desc = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    p_i2s->tx_pool_size = size;
+    p_i2s->tx_pool_count = max_count;
+    ESP_LOGI(I2S_TAG, "TX pool info, size=%d, max_count=%d", size, max_count);
+    return ESP_OK;
+}
+
+/*
+ * Replace tx buffers by dma_buf_count buffers of dma_buf_len frames taken from the 
+ * pool. The DMA is left like after i2s_reset_tx, ready to be primed.
+ */
+esp_err_t i2s_set_tx_geometry(i2s_port_t i2s_num, int dma_buf_count, int dma_buf_len)
+{
+    I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((p_i2s_obj[i2s_num] && p_i2s_obj[i2s_num]->tx_pool), "tx pool not allocated", ESP_ERR_INVALID_STATE);
+    i2s_obj_t *p_i2s = p_i2s_obj[i2s_num];
+    int buf_size = dma_buf_len * p_i2s->bytes_per_sample * p_i2s->channel_num;
+    I2S_CHECK((dma_buf_count >= 2 && dma_buf_count <= p_i2s->tx_pool_count), "tx buffer count exceeds pool", ESP_ERR_INVALID_ARG);
+    I2S_CHECK((buf_size > 0 && buf_size <= 4092 && buf_size * dma_buf_count <= p_i2s->tx_pool_size), "tx buffers exceed pool", ESP_ERR_INVALID_ARG);
+    i2s_dma_t *dma, *old;
+
+    dma = (i2s_dma_t*) calloc(1, sizeof(i2s_dma_t));
+    if (dma) {
+        dma->buf = (char**) malloc(sizeof(char*) * dma_buf_count);
+        dma->desc = (lldesc_t**) malloc(sizeof(lldesc_t*) * dma_buf_count);
+        dma->queue = xQueueCreate(dma_buf_count - 1, sizeof(char*));
+        dma->mux = xSemaphoreCreateMutex();
+    }
+    if (!dma || !dma->buf || !dma->desc || !dma->queue || !dma->mux) {
+        ESP_LOGE(I2S_TAG, "Error malloc tx geometry");
+        if (dma) {
+            free(dma->buf);
+            free(dma->desc);
+            if (dma->queue) vQueueDelete(dma->queue);
+            if (dma->mux) vSemaphoreDelete(dma->mux);
+            free(dma);
+        }
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < dma_buf_count; i++) {
+        dma->buf[i] = p_i2s->tx_pool + i * buf_size;
+        dma->desc[i] = p_i2s->tx_pool_desc + i;
+        dma->desc[i]->owner = 1;
+        dma->desc[i]->eof = 1;
+        dma->desc[i]->sosf = 0;
+        dma->desc[i]->length = buf_size;
+        dma->desc[i]->size = buf_size;
+        dma->desc[i]->buf = (uint8_t *) dma->buf[i];
+        dma->desc[i]->offset = 0;
+        dma->desc[i]->empty = (uint32_t) (p_i2s->tx_pool_desc + (i + 1) % dma_buf_count);
+    }
+    dma->buf_size = buf_size;
+    dma->pooled = true;
+
+    // old buffers might still be in use by i2s_write
+    old = p_i2s->tx;
+    if (old) {
+        xSemaphoreTake(old->mux, (portTickType)portMAX_DELAY);
+    }
+    i2s_stop(i2s_num);
+    if (old) {
+        xSemaphoreGive(old->mux);
+        i2s_destroy_dma_queue(i2s_num, old);
+    }
+    p_i2s->tx = dma;
+    p_i2s->dma_buf_count = dma_buf_count;
+    p_i2s->dma_buf_len = dma_buf_len;
+    I2S[i2s_num]->out_link.addr = (uint32_t) dma->desc[0];
+
+    ESP_LOGI(I2S_TAG, "TX geometry, datalen=blocksize=%d, dma_buf_count=%d", buf_size, dma_buf_count);
+    return i2s_reset_tx(i2s_num);
+}
+
 esp_err_t i2s_driver_install(i2s_port_t i2s_num, const i2s_config_t *i2s_config, int queue_size, void* i2s_queue)
 {
     esp_err_t err;
@@ -1221,6 +1411,11 @@ esp_err_t i2s_driver_uninstall(i2s_port_t i2s_num)
         p_i2s_obj[i2s_num]->i2s_queue = NULL;
     }
 
+    if (p_i2s_obj[i2s_num]->tx_pool) {
+        free(p_i2s_obj[i2s_num]->tx_pool);
+        free(p_i2s_obj[i2s_num]->tx_pool_desc);
+    }
+
     if(p_i2s_obj[i2s_num]->use_apll) {
         rtc_clk_apll_enable(0, 0, 0, 0, 0);
     }
@@ -1253,6 +1448,25 @@ int i2s_write_bytes(i2s_port_t i2s_num, const void *src, size_t size, TickType_t
     }
 }
 
+/*
+ * Account for the buffer i2s_write has just taken, the DMA will reach it once
+ * it has sent all the ones filled before.
+ */
+static void i2s_tx_filled(i2s_port_t i2s_num)
+{
+    i2s_dma_t *tx = p_i2s_obj[i2s_num]->tx;
+
+    for (int i = 0; i < p_i2s_obj[i2s_num]->dma_buf_count; i++) {
+        if (tx->buf[i] == tx->curr_ptr) {
+            I2S_ENTER_CRITICAL();
+            tx->write_idx = i;
+            tx->filled++;
+            I2S_EXIT_CRITICAL();
+            break;
+        }
+    }
+}
+
 esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *bytes_written, TickType_t ticks_to_wait)
 {
     char *data_ptr, *src_byte;
@@ -1272,6 +1486,7 @@ esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *by
                 break;
             }
             p_i2s_obj[i2s_num]->tx->rw_pos = 0;
+            i2s_tx_filled(i2s_num);
         }
         ESP_LOGD(I2S_TAG, "size: %d, rw_pos: %d, buf_size: %d, curr_ptr: %d", size, p_i2s_obj[i2s_num]->tx->rw_pos, p_i2s_obj[i2s_num]->tx->buf_size, (int)p_i2s_obj[i2s_num]->tx->curr_ptr);
         data_ptr = (char*)p_i2s_obj[i2s_num]->tx->curr_ptr;
@@ -1294,6 +1509,47 @@ esp_err_t i2s_write(i2s_port_t i2s_num, const void *src, size_t size, size_t *by
     return ESP_OK;
 }
 
+/*
+ * Bytes that the DMA still has to send before the next one given to i2s_write 
+ * goes out. This is counted from the buffers holding data that the DMA has not 
+ * finished yet, interpolated from the time of the last out_eof inside the buffer 
+ * being sent. After an underrun, the DMA loops over stale (or cleared) buffers 
+ * so nothing is queued and, once writing resumes, what is left of the buffer
+ * being sent must go out first. Must be called from the context that writes.
+ */
+int i2s_get_dma_queued(i2s_port_t i2s_num)
+{
+    I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", 0);
+    I2S_CHECK((p_i2s_obj[i2s_num] && p_i2s_obj[i2s_num]->tx), "tx NULL", 0);
+    i2s_obj_t *p_i2s = p_i2s_obj[i2s_num];
+    i2s_dma_t *tx = p_i2s->tx;
+    int sending, filled, oldest, queued, sent;
+    int64_t elapsed;
+
+    I2S_ENTER_CRITICAL();
+    sending = tx->sending;
+    filled = tx->filled;
+    elapsed = esp_timer_get_time() - tx->eof_time;
+    I2S_EXIT_CRITICAL();
+
+    if (!filled) return 0;
+
+    // what has already been sent from the current buffer
+    if (!tx->running) sent = 0;
+    else sent = (elapsed * (int64_t) p_i2s->real_rate * p_i2s->channel_num * p_i2s->bytes_per_sample) / 1000000;
+    if (sent > tx->buf_size) sent = tx->buf_size;
+    else if (sent < 0) sent = 0;
+
+    queued = (filled - 1) * tx->buf_size + tx->rw_pos;
+    oldest = (tx->write_idx - filled + 1 + p_i2s->dma_buf_count) % p_i2s->dma_buf_count;
+
+    // DMA is in our oldest buffer, otherwise it is finishing a stale one just before
+    if (oldest == sending) queued -= sent;
+    else if (tx->running) queued += tx->buf_size - sent;
+
+    return queued > 0 ? queued : 0;
+}
+
 esp_err_t i2s_adc_enable(i2s_port_t i2s_num)
 {
     I2S_CHECK((i2s_num < I2S_NUM_MAX), "i2s_num error", ESP_ERR_INVALID_ARG);
@@ -1355,6 +1611,7 @@ esp_err_t i2s_write_expand(i2s_port_t i2s_num, const void *src, size_t size, siz
                 break;
             }
             p_i2s_obj[i2s_num]->tx->rw_pos = 0;
+            i2s_tx_filled(i2s_num);
         }
         data_ptr = (char*)p_i2s_obj[i2s_num]->tx->curr_ptr;
         data_ptr += p_i2s_obj[i2s_num]->tx->rw_pos;
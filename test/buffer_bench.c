@@ -0,0 +1,126 @@
+/*
+ *  Squeezelite for esp32 - host benchmark
+ *
+ *  outputbuf contention: a producer (codec) and a consumer (output) move data through a
+ *  buffer while a third thread polls occupancy the way decoder does. Consumer's lock wait
+ *  (what output_bt reports as lock_out_time) and throughput are measured with:
+ *  - locked poll: occupancy read under the mutex (before lock-free indexes)
+ *  - lock-free poll: occupancy read without the mutex (decoder and BT stats now)
+ *  - lock-free transfer: no mutex at all, what moving codecs and output would bring
+ */
+
+#include "squeezelite.h"
+
+#include <time.h>
+
+log_level loglevel = lWARN;
+
+#define BUF_SIZE	(64 * 1024)
+#define IN_CHUNK	(4 * 1024)
+#define OUT_CHUNK	(1 * 1024)
+#define TOTAL		(128 * 1024 * 1024)
+
+static struct buffer buf;
+static bool poll_locked, transfer_locked;
+static volatile bool done;
+static u64_t wait_total, wait_max, waits, polls;
+
+static u64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *producer(void *arg) {
+	static u8_t chunk[IN_CHUNK];
+	size_t total = TOTAL;
+
+	while (total) {
+		unsigned n;
+
+		if (transfer_locked) mutex_lock(buf.mutex);
+		n = min(min(_buf_space(&buf), _buf_cont_write(&buf)), IN_CHUNK);
+		memcpy(buf.writep, chunk, n);
+		_buf_inc_writep(&buf, n);
+		if (transfer_locked) mutex_unlock(buf.mutex);
+
+		if (!n) sched_yield();
+		total -= n;
+	}
+
+	return NULL;
+}
+
+static void *poller(void *arg) {
+	unsigned used = 0;
+
+	while (!done) {
+		if (poll_locked) mutex_lock(buf.mutex);
+		used += _buf_used(&buf);
+		if (poll_locked) mutex_unlock(buf.mutex);
+		polls++;
+	}
+
+	return (void*) (uintptr_t) used;
+}
+
+static void consumer(void) {
+	static u8_t chunk[OUT_CHUNK];
+	size_t total = TOTAL;
+
+	while (total) {
+		unsigned n;
+
+		if (transfer_locked) {
+			u64_t start = now_ns(), wait;
+			mutex_lock(buf.mutex);
+			wait = now_ns() - start;
+			wait_total += wait;
+			wait_max = max(wait_max, wait);
+			waits++;
+		}
+
+		n = min(_buf_cont_read(&buf), OUT_CHUNK);
+		memcpy(chunk, buf.readp, n);
+		_buf_inc_readp(&buf, n);
+		if (transfer_locked) mutex_unlock(buf.mutex);
+
+		if (!n) sched_yield();
+		total -= n;
+	}
+}
+
+static void run(const char *name, bool locked_poll, bool locked_transfer) {
+	pthread_t producer_thread, poller_thread;
+	u64_t start;
+
+	poll_locked = locked_poll;
+	transfer_locked = locked_transfer;
+	done = false;
+	wait_total = wait_max = waits = polls = 0;
+	buf.readp = buf.writep = buf.buf;
+
+	start = now_ns();
+	pthread_create(&poller_thread, NULL, poller, NULL);
+	pthread_create(&producer_thread, NULL, producer, NULL);
+	consumer();
+	pthread_join(producer_thread, NULL);
+	start = now_ns() - start;
+	done = true;
+	pthread_join(poller_thread, NULL);
+
+	printf("%-20s %8.1f MB/s %10.1f %10.1f %12.1f\n", name, (double) TOTAL / start * 1e3,
+		   waits ? (double) wait_total / waits : 0, wait_max / 1e3, (double) polls / start * 1e3);
+}
+
+int main(void) {
+	buf_init(&buf, BUF_SIZE, 0);
+
+	printf("%-20s %13s %10s %10s %12s\n", "", "throughput", "wait(ns)", "max(us)", "polls/us");
+	run("locked poll", true, true);
+	run("lock-free poll", false, true);
+	run("lock-free transfer", false, false);
+
+	buf_destroy(&buf);
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ *  Squeezelite for esp32 - host benchmark
+ *
+ *  eq stage speed for 1 to 10 bands at 44.1kHz, in ns per frame per band and as a factor
+ *  of realtime
+ */
+
+#include "squeezelite.h"
+
+#include <time.h>
+
+log_level loglevel = lWARN;
+
+#define SECONDS	4
+#define RATE	44100
+#define CHUNK	1024
+
+static struct processstate process;
+
+static u64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// time to process frames (by chunks), in ns
+static u64_t run_eq(ISAMPLE_T *in, int frames) {
+	u64_t start = now_ns();
+
+	while (frames) {
+		process.in_frames = min(frames, CHUNK);
+		memcpy(process.inbuf, in, process.in_frames * BYTES_PER_FRAME);
+		eq_samples(&process);
+		in += process.in_frames * 2;
+		frames -= process.in_frames;
+	}
+
+	return now_ns() - start;
+}
+
+int main(void) {
+	int frames = RATE * SECONDS, bands, i;
+	ISAMPLE_T *in = malloc(frames * BYTES_PER_FRAME);
+	u32_t seed = 2;
+
+	for (i = 0; i < frames * 2; i++) {
+		seed = seed * 1664525 + 1013904223;
+		in[i] = (ISAMPLE_T) ((s32_t) seed >> (32 - BYTES_PER_FRAME * 4 + 2));
+	}
+
+	process.max_out_frames = CHUNK;
+	process.inbuf = malloc(CHUNK * BYTES_PER_FRAME);
+	process.outbuf = malloc(CHUNK * BYTES_PER_FRAME);
+
+	printf("%-8s %18s %14s\n", "bands", "ns/frame/band", "realtime");
+
+	for (bands = 1; bands <= 10; bands++) {
+		char curve[256] = "";
+		u64_t ns;
+
+		// low shelf, peaks an octave apart, high shelf
+		for (i = 0; i < bands; i++) {
+			char band[32];
+			if (i == 0) sprintf(band, "l80/4");
+			else if (i == bands - 1 && bands > 2) sprintf(band, ";h8000/-2");
+			else sprintf(band, ";p%d/-3/1.5", 150 << (i - 1));
+			strcat(curve, band);
+		}
+
+		if (!eq_init(curve) || !eq_newstream(&process, RATE, NULL)) {
+			printf("can't init eq with %s\n", curve);
+			return 1;
+		}
+
+		ns = run_eq(in, frames);
+		printf("%-8d %18.2f %13.1fx\n", bands, (double) ns / frames / bands, (double) SECONDS * 1e9 / ns);
+	}
+
+	return 0;
+}
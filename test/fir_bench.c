@@ -0,0 +1,129 @@
+/*
+ *  Squeezelite for esp32 - host benchmark
+ *
+ *  fir stage speed as a factor of realtime at 44.1kHz and 96kHz, for several numbers of
+ *  taps, against a direct (time domain) convolution of the same taps
+ */
+
+#include "squeezelite.h"
+
+#include <math.h>
+#include <time.h>
+
+log_level loglevel = lWARN;
+
+#define SECONDS	4
+#define CHUNK	1024
+
+static struct processstate process;
+
+static u64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static float *make_taps(int ntaps, char *name) {
+	float *taps = malloc(ntaps * sizeof(float));
+	int fd = mkstemp(name), i;
+	FILE *f = fdopen(fd, "w");
+	u32_t seed = 1;
+
+	for (i = 0; i < ntaps; i++) {
+		seed = seed * 1664525 + 1013904223;
+		taps[i] = ((s32_t) seed >> 8) / (float) (1 << 23) / ntaps;
+		fprintf(f, "%.9g\n", taps[i]);
+	}
+
+	fclose(f);
+	return taps;
+}
+
+// time to process frames (by chunks), in ns
+static u64_t run_fir(ISAMPLE_T *in, int frames) {
+	u64_t start = now_ns();
+
+	while (frames) {
+		process.in_frames = min(frames, CHUNK);
+		memcpy(process.inbuf, in, process.in_frames * BYTES_PER_FRAME);
+		fir_samples(&process);
+		in += process.in_frames * 2;
+		frames -= process.in_frames;
+	}
+
+	return now_ns() - start;
+}
+
+// plain convolution, history is kept in front of the input
+static u64_t run_direct(ISAMPLE_T *in, int frames, float *taps, int ntaps) {
+	float *x = calloc((frames + ntaps) * 2, sizeof(float));
+	ISAMPLE_T *out = malloc(frames * BYTES_PER_FRAME);
+	u64_t start;
+	int i, t;
+
+	for (i = 0; i < frames * 2; i++) x[ntaps * 2 + i] = in[i];
+
+	start = now_ns();
+	for (i = 0; i < frames; i++) {
+		float l = 0, r = 0, *p = x + (ntaps + i) * 2;
+		for (t = 0; t < ntaps; t++, p -= 2) {
+			l += taps[t] * p[0];
+			r += taps[t] * p[1];
+		}
+		out[2*i] = lrintf(l);
+		out[2*i+1] = lrintf(r);
+	}
+	start = now_ns() - start;
+
+	// keep the compiler from dropping the loop
+	if (out[frames] == 0x1234) printf(" ");
+
+	free(x);
+	free(out);
+	return start;
+}
+
+int main(void) {
+	int ntaps[] = { 128, 512, 2048, 8192, 16384 }, rates[] = { 44100, 96000 }, i, r;
+	int frames = 96000 * SECONDS;
+	ISAMPLE_T *in = malloc(frames * BYTES_PER_FRAME);
+	u32_t seed = 2;
+
+	for (i = 0; i < frames * 2; i++) {
+		seed = seed * 1664525 + 1013904223;
+		in[i] = (ISAMPLE_T) ((s32_t) seed >> (32 - BYTES_PER_FRAME * 4 + 2));
+	}
+
+	process.max_out_frames = CHUNK;
+	process.inbuf = malloc(CHUNK * BYTES_PER_FRAME);
+	process.outbuf = malloc(CHUNK * BYTES_PER_FRAME);
+
+	printf("%-8s %8s %14s %14s\n", "taps", "rate", "fir", "direct");
+
+	for (i = 0; i < sizeof(ntaps) / sizeof(*ntaps); i++) {
+		char name[] = "/tmp/fir_benchXXXXXX";
+		float *taps = make_taps(ntaps[i], name);
+		int direct = min(frames, 200000000 / ntaps[i]);
+
+		if (!fir_init(name)) {
+			printf("can't init fir with %d taps\n", ntaps[i]);
+			return 1;
+		}
+		unlink(name);
+
+		for (r = 0; r < sizeof(rates) / sizeof(*rates); r++) {
+			int n = rates[r] * SECONDS;
+			double fir_x, direct_x;
+
+			fir_newstream(&process, rates[r], NULL);
+			fir_x = (double) n / rates[r] * 1e9 / run_fir(in, n);
+			direct_x = (double) direct / rates[r] * 1e9 / run_direct(in, direct, taps, ntaps[i]);
+
+			printf("%-8d %8d %13.1fx %13.1fx\n", ntaps[i], rates[r], fir_x, direct_x);
+		}
+
+		free(taps);
+	}
+
+	return 0;
+}
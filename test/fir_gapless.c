@@ -0,0 +1,118 @@
+/*
+ *  Squeezelite for esp32 - host check
+ *
+ *  fir across tracks: a signal played as two gapless tracks at the same rate must come
+ *  out exactly as when played as a single one, while a rate change starts from silence
+ */
+
+#include "squeezelite.h"
+
+log_level loglevel = lWARN;
+
+#define TAPS	3000
+#define FRAMES	20000
+#define SPLIT	7777
+#define CHUNK	1000
+
+#if BYTES_PER_FRAME == 4
+#define GAPLESS_TOLERANCE	1
+#else
+#define GAPLESS_TOLERANCE	(1 << 16)
+#endif
+
+static struct processstate process;
+static ISAMPLE_T in[FRAMES * 2], ref[(FRAMES + 1024) * 2], out[(FRAMES + 1024) * 2];
+
+// feed frames by chunks (as process does) and append output
+static int play(ISAMPLE_T *src, int frames, ISAMPLE_T *dst) {
+	int done = 0;
+
+	while (frames) {
+		process.in_frames = min(frames, CHUNK);
+		memcpy(process.inbuf, src, process.in_frames * BYTES_PER_FRAME);
+		fir_samples(&process);
+		memcpy(dst + done * 2, process.outbuf, process.out_frames * BYTES_PER_FRAME);
+		done += process.out_frames;
+		src += process.in_frames * 2;
+		frames -= process.in_frames;
+	}
+
+	do {
+		bool end = fir_drain(&process);
+		memcpy(dst + done * 2, process.outbuf, process.out_frames * BYTES_PER_FRAME);
+		done += process.out_frames;
+		if (end) break;
+	} while (1);
+
+	return done;
+}
+
+int main(void) {
+	char name[] = "/tmp/fir_gaplessXXXXXX", opt[64];
+	int fd = mkstemp(name), i, n, errors = 0;
+	FILE *f = fdopen(fd, "w");
+	u32_t seed = 1;
+
+	for (i = 0; i < TAPS; i++) {
+		seed = seed * 1664525 + 1013904223;
+		fprintf(f, "%f\n", ((s32_t) seed >> 8) / (float) (1 << 23) / 200);
+	}
+	fclose(f);
+
+	for (i = 0; i < FRAMES * 2; i++) {
+		seed = seed * 1664525 + 1013904223;
+		in[i] = (ISAMPLE_T) ((s32_t) seed >> 2);
+	}
+
+	sprintf(opt, "%s", name);
+	if (!fir_init(opt)) {
+		printf("fir gapless: can't init\n");
+		return 1;
+	}
+	unlink(name);
+
+	process.max_out_frames = 2 * CHUNK;
+	process.inbuf = malloc(process.max_out_frames * BYTES_PER_FRAME);
+	process.outbuf = malloc(process.max_out_frames * BYTES_PER_FRAME);
+
+	// single track
+	fir_newstream(&process, 44100, NULL);
+	n = play(in, FRAMES, ref);
+
+	// same signal as two tracks, after a flush
+	fir_flush();
+	fir_newstream(&process, 44100, NULL);
+	i = play(in, SPLIT, out);
+	fir_newstream(&process, 44100, NULL);
+	i += play(in + SPLIT * 2, FRAMES - SPLIT, out + i * 2);
+
+	if (i != n) {
+		printf("gapless tracks produced %d frames, single track %d\n", i, n);
+		errors++;
+	}
+
+	// frames sent by drain are computed with silence in the last block, so they are only
+	// equal within FFT rounding, which is below 16 bits resolution
+	for (i = 0; i < n * 2; i++) {
+		s32_t d = ref[i] > out[i] ? ref[i] - out[i] : out[i] - ref[i];
+		if (d > GAPLESS_TOLERANCE) {
+			printf("gapless tracks differ from single track at frame %d (%d %d)\n", i / 2, (int) ref[i], (int) out[i]);
+			errors++;
+			break;
+		}
+	}
+
+	// a rate change starts from silence
+	fir_newstream(&process, 44100, NULL);
+	play(in, SPLIT, out);
+	fir_newstream(&process, 48000, NULL);
+	play(in, SPLIT, out);
+	for (i = 0; i < FRAMES && !out[i * 2] && !out[i * 2 + 1]; i++);
+	if (i < 256) {
+		printf("rate change kept previous track (%d frames of silence)\n", i);
+		errors++;
+	}
+
+	printf("fir gapless: %s\n", errors ? "FAILED" : "ok");
+	return errors ? 1 : 0;
+}
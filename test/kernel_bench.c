@@ -0,0 +1,246 @@
+/*
+ *  Squeezelite for esp32 - host benchmark
+ *
+ *  ns/frame of the sample conversion kernels: output pack (fused cross-fade/gain/pack, 
+ *  plain pack, TPDF and shaped dither against plain), pcm decode, flac interleave 
+ *  (write_cb) and mad scale. flac.c is included so that its static callback can be 
+ *  reached, with the library replaced by stubs, and mad's scale() is extracted from
+ *  mad.c (see Makefile). Built with -DNO_UNROLL, it gives the same kernels not unrolled
+ */
+
+#include "../components/squeezelite/flac.c"
+
+#include <mad.h>
+#include "mad_scale.h"
+
+#include <time.h>
+
+log_level loglevel = lWARN;
+
+struct buffer buf, obuf;
+struct buffer *streambuf = &buf, *outputbuf = &obuf;
+struct streamstate stream;
+struct outputstate output;
+struct decodestate decode;
+#if PROCESS
+struct processstate process;
+#endif
+
+unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) { return sample_rate; }
+void _checkfade(bool start) { }
+struct codec *register_pcm(void);
+
+// flac library is not needed, only write_cb is measured
+const char * const FLAC__StreamDecoderErrorStatusString[] = { "" };
+const char * const FLAC__StreamDecoderStateString[] = { "" };
+FLAC__StreamDecoder *FLAC__stream_decoder_new(void) { return NULL; }
+FLAC__bool FLAC__stream_decoder_reset(FLAC__StreamDecoder *decoder) { return true; }
+void FLAC__stream_decoder_delete(FLAC__StreamDecoder *decoder) { }
+FLAC__StreamDecoderInitStatus FLAC__stream_decoder_init_stream(FLAC__StreamDecoder *decoder, FLAC__StreamDecoderReadCallback read_callback,
+		FLAC__StreamDecoderSeekCallback seek_callback, FLAC__StreamDecoderTellCallback tell_callback, FLAC__StreamDecoderLengthCallback length_callback,
+		FLAC__StreamDecoderEofCallback eof_callback, FLAC__StreamDecoderWriteCallback write_callback, FLAC__StreamDecoderMetadataCallback metadata_callback,
+		FLAC__StreamDecoderErrorCallback error_callback, void *client_data) { return 0; }
+FLAC__bool FLAC__stream_decoder_process_single(FLAC__StreamDecoder *decoder) { return true; }
+FLAC__StreamDecoderState FLAC__stream_decoder_get_state(const FLAC__StreamDecoder *decoder) { return 0; }
+
+#define FRAMES	4096
+#define LOOPS	2000
+
+#if NO_UNROLL
+#define UNROLLED	", not unrolled"
+#else
+#define UNROLLED	""
+#endif
+
+static u64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, u64_t ns, unsigned long frames) {
+	printf("%-32s %6.2f ns/frame\n", name, (double) ns / frames);
+}
+
+// same, with cost relative to a reference path
+static void report_vs(const char *name, u64_t ns, unsigned long frames, u64_t ref) {
+	printf("%-32s %6.2f ns/frame (x%.2f)\n", name, (double) ns / frames, (double) ns / ref);
+}
+
+// pack with gain, dithered when narrowing to 16 bits, against the plain path
+static void bench_dither(void) {
+	static u8_t out[FRAMES * 8];
+	dither_mode modes[] = { DITHER_TPDF, DITHER_SHAPED };
+	const char *names[] = { "pack S16 gain TPDF dither", "pack S16 gain shaped dither" };
+	s32_t half = 0x8000;
+	u64_t start, ref;
+	int i, m;
+
+	output.dither = DITHER_OFF;
+	_cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S16_LE);
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) _cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S16_LE);
+	ref = now_ns() - start;
+
+	for (m = 0; m < sizeof(modes) / sizeof(*modes); m++) {
+		output.dither = modes[m];
+		start = now_ns();
+		for (i = 0; i < LOOPS; i++) _cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S16_LE);
+		report_vs(names[m], now_ns() - start, FRAMES * LOOPS, ref);
+	}
+
+	output.dither = DITHER_OFF;
+}
+
+static void reset_output(void) {
+	outputbuf->readp = outputbuf->writep = outputbuf->buf;
+}
+
+static void bench_pack(void) {
+	static u8_t out[FRAMES * 8];
+	ISAMPLE_T *cross;
+	s32_t half = 0x8000;
+	u64_t start;
+	int i;
+
+	// first call starts the gain ramp, let it complete before measuring
+	output.current_sample_rate = 44100;
+	_cross_scale_and_pack_frames(out, outputbuf, FRAMES, FIXED_ONE, FIXED_ONE, 0, 0, NULL, S16_LE);
+
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) _cross_scale_and_pack_frames(out, outputbuf, FRAMES, FIXED_ONE, FIXED_ONE, 0, 0, NULL, S16_LE);
+	report("pack S16 unity", now_ns() - start, FRAMES * LOOPS);
+
+	_cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S16_LE);
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) _cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S16_LE);
+	report("pack S16 gain", now_ns() - start, FRAMES * LOOPS);
+
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) {
+		cross = (ISAMPLE_T*) (outputbuf->buf + FRAMES * BYTES_PER_FRAME);
+		_cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, half, half, &cross, S16_LE);
+	}	
+	report("pack S16 gain + cross-fade", now_ns() - start, FRAMES * LOOPS);
+
+#if BYTES_PER_FRAME == 8
+	_cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S32_LE);
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) _cross_scale_and_pack_frames(out, outputbuf, FRAMES, half, half, 0, 0, NULL, S32_LE);
+	report("pack S32 gain", now_ns() - start, FRAMES * LOOPS);
+
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) _scale_and_pack_frames(out, (s32_t*) outputbuf->buf, FRAMES, half, half, S24_3LE);
+	report("pack S24_3LE gain (not fused)", now_ns() - start, FRAMES * LOOPS);
+#endif
+}
+
+static void bench_pcm(const char *name, u8_t size, u8_t endianness) {
+	struct codec *codec = register_pcm();
+	u64_t ns = 0;
+	unsigned long frames = 0;
+	int i;
+
+	// first decode sets frame format up
+	codec->open(size, '3', '2', endianness);
+	decode.new_stream = true;
+	_buf_flush(streambuf);
+	_buf_inc_writep(streambuf, FRAMES * (size - '0' + 1) * 2);
+	codec->decode();
+
+	for (i = 0; i < LOOPS; i++) {
+		u64_t start;
+		unsigned used;
+		_buf_flush(streambuf);
+		_buf_inc_writep(streambuf, FRAMES * (size - '0' + 1) * 2);
+		reset_output();
+		used = _buf_used(outputbuf);
+		start = now_ns();
+		codec->decode();
+		ns += now_ns() - start;
+		frames += (_buf_used(outputbuf) - used) / BYTES_PER_FRAME;
+	}
+
+	report(name, ns, frames);
+}
+
+static void bench_flac(const char *name, unsigned bits) {
+	static FLAC__int32 left[FRAMES], right[FRAMES];
+	const FLAC__int32 *buffer[2] = { left, right };
+	FLAC__Frame frame;
+	u64_t start, ns = 0;
+	int i;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.header.blocksize = FRAMES;
+	frame.header.channels = 2;
+	frame.header.bits_per_sample = bits;
+	frame.header.sample_rate = 44100;
+	decode.new_stream = false;
+
+	for (i = 0; i < LOOPS; i++) {
+		reset_output();
+		start = now_ns();
+		write_cb(NULL, &frame, buffer, NULL);
+		ns += now_ns() - start;
+	}
+
+	report(name, ns, FRAMES * LOOPS);
+}
+
+// same loop as mad.c's output, and unrolled
+static void bench_mad(bool unroll) {
+	static mad_fixed_t left[FRAMES], right[FRAMES];
+	u64_t start, ns = 0;
+	u32_t seed = 3;
+	int i;
+
+	for (i = 0; i < FRAMES; i++) {
+		seed = seed * 1664525 + 1013904223;
+		left[i] = (s32_t) seed >> 2;
+		right[i] = -left[i];
+	}
+
+	for (i = 0; i < LOOPS; i++) {
+		mad_fixed_t *iptrl = left, *iptrr = right;
+		ISAMPLE_T *optr;
+		reset_output();
+		optr = (ISAMPLE_T*) outputbuf->writep;
+		start = now_ns();
+		if (unroll) {
+			UNROLL4(FRAMES, *optr++ = scale(*iptrl++); *optr++ = scale(*iptrr++));
+		} else {
+			size_t count = FRAMES;
+			while (count--) {
+				*optr++ = scale(*iptrl++);
+				*optr++ = scale(*iptrr++);
+			}
+		}
+		ns += now_ns() - start;
+	}
+
+	report(unroll ? "mad scale (UNROLL4)" : "mad scale", ns, FRAMES * LOOPS);
+}
+
+int main(void) {
+	buf_init(streambuf, FRAMES * 8 * 2, STREAMBUF_TAIL);
+	buf_init(outputbuf, FRAMES * BYTES_PER_FRAME * 4, 0);
+#if PROCESS
+	decode.direct = true;
+#endif
+	stream.state = STREAMING_HTTP;
+
+	printf("BYTES_PER_FRAME %d, %d frames x %d%s\n", BYTES_PER_FRAME, FRAMES, LOOPS, UNROLLED);
+
+	bench_pack();
+	bench_dither();
+	bench_pcm("pcm 16 bits LE", '1', '1');
+	bench_pcm("pcm 16 bits BE", '1', '0');
+	bench_pcm("pcm 24 bits LE", '2', '1');
+	bench_flac("flac 16 bits", 16);
+	bench_flac("flac 24 bits", 24);
+	bench_mad(false);
+	bench_mad(true);
+
+	return 0;
+}
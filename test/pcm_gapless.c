@@ -0,0 +1,83 @@
+/*
+ *  Squeezelite for esp32 - host check
+ *
+ *  pcm -> pcm gapless transition: the second track is prefetched in its own buffer,
+ *  swapped in and pcm codec is re-opened, its first frames must still be played
+ */
+
+#include "squeezelite.h"
+
+log_level loglevel = lWARN;
+
+struct buffer buf, nextbuf, obuf;
+struct buffer *streambuf = &buf, *prefetchbuf = &nextbuf, *outputbuf = &obuf;
+struct streamstate stream;
+struct outputstate output;
+struct decodestate decode;
+#if PROCESS
+struct processstate process;
+#endif
+
+unsigned decode_newstream(unsigned sample_rate, unsigned supported_rates[]) { return sample_rate; }
+void _checkfade(bool start) { }
+
+struct codec *register_pcm(void);
+
+#define TRACK_FRAMES 20000
+
+static void fill(struct buffer *b, s16_t base, int frames) {
+	while (frames) {
+		int n = min(_buf_space(b), _buf_cont_write(b)) / 4, i;
+		s16_t *p = (s16_t*) b->writep;
+		n = min(n, frames);
+		for (i = 0; i < n; i++, base++) *p++ = base, *p++ = -base;
+		_buf_inc_writep(b, n * 4);
+		frames -= n;
+	}
+}
+
+static void decode_track(struct codec *codec) {
+	decode.new_stream = true;
+	while (codec->decode() == DECODE_RUNNING);
+}
+
+int main(void) {
+	struct codec *codec;
+	s16_t *out;
+	int i, errors = 0;
+
+	buf_init(streambuf, 64 * 1024, STREAMBUF_TAIL);
+	buf_init(prefetchbuf, 64 * 1024, STREAMBUF_TAIL);
+	buf_init(outputbuf, 4 * TRACK_FRAMES * BYTES_PER_FRAME, 0);
+#if PROCESS
+	decode.direct = true;
+#endif
+	stream.state = DISCONNECT;
+
+	// 16 bits, 44.1kHz, stereo, little endian
+	codec = register_pcm();
+	codec->open('1', '3', '2', '1');
+
+	fill(streambuf, 0, 10000);
+	// next track is fully received while current one is decoded
+	stream.prefetch = true;
+	fill(prefetchbuf, 10000, 10000);
+	decode_track(codec);
+
+	// what decoder does when current track completes
+	stream.prefetch = false;
+	_buf_swap(streambuf, prefetchbuf);
+	codec->open('1', '3', '2', '1');
+	decode_track(codec);
+
+	out = (s16_t*) outputbuf->readp;
+	for (i = 0; i < TRACK_FRAMES && i < _buf_used(outputbuf) / BYTES_PER_FRAME; i++) {
+		s32_t l = out[i * BYTES_PER_FRAME / 2 + (BYTES_PER_FRAME == 8)];
+		if (l != (s16_t) i && errors++ < 5) printf("frame %d: %d, expecting %d\n", i, l, i);
+	}
+
+	if (i != TRACK_FRAMES) printf("got %d frames, expecting %d\n", i, TRACK_FRAMES);
+	printf("pcm gapless: %s\n", errors || i != TRACK_FRAMES ? "FAILED" : "ok");
+
+	return errors || i != TRACK_FRAMES;
+}
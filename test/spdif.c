@@ -0,0 +1,189 @@
+/*
+ *  Squeezelite for esp32 - host check and benchmark of S/PDIF encoder
+ *
+ *  The encoder is extracted from output_i2s.c (see Makefile). The check decodes the
+ *  BMC stream (transitions, preambles, parity, audio) and, with 16 bits samples,
+ *  compares it bit for bit with the original encoder kept here as reference. Built
+ *  with -DBENCH, it reports ns/frame of both.
+ */
+
+#include "squeezelite.h"
+
+#include <time.h>
+
+#define DRAM_ATTR
+#include "spdif_encode.h"
+
+#define FRAMES	4096
+#define LOOPS	2000
+
+/*
+ original encoder, 16 bits only (the 32 bits version only sent the 8 MSB)
+*/
+static void spdif_convert_ref(ISAMPLE_T *src, size_t frames, u32_t *dst, size_t *count) {
+	u16_t hi, lo, aux;
+
+	// frames are 2 channels of 16 bits
+	frames *= 2;
+
+	while (frames--) {
+#if BYTES_PER_FRAME == 4
+		hi  = spdif_bmclookup[(u8_t)(*src >> 8)];
+		lo  = spdif_bmclookup[(u8_t) *src];
+#else
+		hi  = spdif_bmclookup[(u8_t)(*src >> 24)];
+		lo  = spdif_bmclookup[(u8_t) *src >> 16];
+#endif
+		lo ^= ~((s16_t)hi) >> 16;
+
+		// 16 bits sample:
+		*(dst+0) = ((u32_t)lo << 16) | hi;
+
+		// 4 bits auxillary-audio-databits, the first used as parity
+		aux = 0xb333 ^ (((u32_t)((s16_t)lo)) >> 17);
+
+		// VUCP-Bits: Valid, Subcode, Channelstatus, Parity = 0
+		// As parity is always 0, we can use fixed preambles
+		if (++(*count) > 383) {
+			*(dst+1) =  VUCP | (PREAMBLE_B << 16 ) | aux; //special preamble for one of 192 frames
+			*count = 0;
+		} else {
+			*(dst+1) = VUCP | ((((*count) & 0x01) ? PREAMBLE_W : PREAMBLE_M) << 16) | aux;
+		}
+
+		src++;
+		dst += 2;
+	}
+}
+
+static ISAMPLE_T src[FRAMES * 2];
+static u32_t dst[FRAMES * 4];
+#if BYTES_PER_FRAME == 4 || defined(BENCH)
+static u32_t ref[FRAMES * 4];
+#endif
+
+static u32_t rnd(void) {
+	static u32_t seed = 0x12345678;
+	seed = seed * 1664525 + 1013904223;
+	return seed;
+}
+
+static void fill(void) {
+	int i;
+
+	for (i = 0; i < FRAMES * 2; i++) {
+		// some full scale and silence, the rest random
+		if (i % 97 == 0) src[i] = (i & 1) ? (ISAMPLE_T) -1 << (BYTES_PER_FRAME * 4 - 1) : ~((ISAMPLE_T) -1 << (BYTES_PER_FRAME * 4 - 1));
+		else if (i % 89 == 0) src[i] = 0;
+		else src[i] = (ISAMPLE_T) rnd();
+	}
+}
+
+#ifndef BENCH
+/*
+ the DMA sends, for each sample, dst[1] then dst[0], MSB first. A subframe starts
+ with the preamble in dst[1] and ends with VUCP, sent in next sample's dst[1]
+*/
+static int cell(u32_t *words, int n) {
+	u32_t word = words[(n / 64) * 2 + ((n / 32) & 1 ? 0 : 1)];
+	return (word >> (31 - n % 32)) & 0x01;
+}
+
+static int check_stream(u32_t *words, int samples, size_t start) {
+	int n, i, errors = 0, level = cell(words, 7);
+	size_t count = start;
+
+	for (n = 0; n < samples - 1; n++) {
+		int base = n * 64 + 8, parity = 0;
+		u32_t bits = 0;
+		u8_t preamble = 0;
+
+		// preamble must start with a transition and be the expected one
+		for (i = 0; i < 8; i++) preamble = (preamble << 1) | cell(words, base + i);
+		if (++count > 383) count = 0;
+		if (level || preamble != (count ? ((count & 0x01) ? PREAMBLE_W : PREAMBLE_M) : PREAMBLE_B)) {
+			if (errors++ < 8) printf("subframe %d: preamble %02x after level %d\n", n, preamble, level);
+		}
+		level = cell(words, base + 7);
+
+		// then 28 slots with a transition at each boundary, data is a transition in the middle
+		for (i = 0; i < 28; i++) {
+			int a = cell(words, base + 8 + i * 2), b = cell(words, base + 9 + i * 2);
+			if (a == level) {
+				if (errors++ < 8) printf("subframe %d: no transition at slot %d\n", n, i + 4);
+			}
+			bits |= (u32_t) (a != b) << i;
+			parity ^= a != b;
+			level = b;
+		}
+
+		// 24 bits (aux + audio), then V, U, C, P
+		if (parity) {
+			if (errors++ < 8) printf("subframe %d: odd parity\n", n);
+		}
+		if (bits & (0x07 << 24)) {
+			if (errors++ < 8) printf("subframe %d: VUC set %x\n", n, (bits >> 24) & 0x07);
+		}
+#if BYTES_PER_FRAME == 4
+		if (((bits >> 8) & 0xffff) != (u16_t) src[n]) {
+#else
+		if ((bits & 0xffffff) != ((u32_t) src[n] >> 8)) {
+#endif
+			if (errors++ < 8) printf("subframe %d: audio %06x for %08x\n", n, bits & 0xffffff, (u32_t) src[n]);
+		}
+	}
+
+	return errors;
+}
+
+int main(void) {
+	size_t count = 0, start;
+	int errors = 0, pass;
+#if BYTES_PER_FRAME == 4
+	size_t count_ref = 0;
+#endif
+
+	fill();
+
+	// several calls, so that block boundaries and the 192 frames block rolls are crossed
+	for (pass = 0; pass < 3; pass++) {
+		start = count;
+		spdif_convert(src, FRAMES, dst, &count);
+		errors += check_stream(dst, FRAMES * 2, start);
+#if BYTES_PER_FRAME == 4
+		spdif_convert_ref(src, FRAMES, ref, &count_ref);
+		if (memcmp(dst, ref, FRAMES * 2 * 2 * sizeof(u32_t)) || count != count_ref) {
+			printf("pass %d: differs from reference encoder\n", pass);
+			errors++;
+		}
+#endif
+	}
+
+	printf("spdif %d bits: %s\n", BYTES_PER_FRAME * 4, errors ? "FAILED" : "ok");
+	return errors ? 1 : 0;
+}
+#else
+static u64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(void) {
+	size_t count = 0;
+	u64_t start;
+	int i;
+
+	fill();
+
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) spdif_convert(src, FRAMES, dst, &count);
+	printf("%-32s %6.2f ns/frame\n", "spdif_convert", (double) (now_ns() - start) / (FRAMES * LOOPS));
+
+	start = now_ns();
+	for (i = 0; i < LOOPS; i++) spdif_convert_ref(src, FRAMES, ref, &count);
+	printf("%-32s %6.2f ns/frame\n", "spdif_convert (original)", (double) (now_ns() - start) / (FRAMES * LOOPS));
+
+	return 0;
+}
+#endif